@@ -0,0 +1,129 @@
+// BenchSupport.hpp
+
+#pragma once
+#ifndef BenchSupport_HEADER
+#define BenchSupport_HEADER
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <functional>
+#include <stdexcept>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <new>
+#include <cstdint>
+#include <cstdlib>
+
+#include <spawn.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+// Define BENCH_COUNT_ALLOCATIONS before including this in the one translation unit of a benchmark.
+#ifdef BENCH_COUNT_ALLOCATIONS
+
+// Every heap allocation in the process is counted, so results include what asio allocates.
+std::atomic<std::size_t> g_allocations{0};
+
+void* operator new(std::size_t size)
+{
+    ++g_allocations;
+    if (void* pointer = std::malloc(size ? size : 1)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept
+{
+    std::free(pointer);
+}
+
+#endif
+
+namespace BenchSupport {
+
+    // "1K,64K,1M" -> numbers, plain numbers are taken as they are.
+    inline std::vector<std::uint64_t> parseList(const std::string& list)
+    {
+        std::vector<std::uint64_t> values;
+        std::stringstream stream(list);
+        std::string item;
+        while (std::getline(stream, item, ',')) {
+            char* end;
+            std::uint64_t value = std::strtoull(item.c_str(), &end, 10);
+            switch (*end) {
+                case 'K': case 'k': value <<= 10; break;
+                case 'M': case 'm': value <<= 20; break;
+                case 'G': case 'g': value <<= 30; break;
+                default: break;
+            }
+            values.push_back(value);
+        }
+        return values;
+    }
+
+    // A throwaway server process, terminated when this goes away.
+    class ServerProcess {
+    public:
+        ServerProcess() = default;
+        ServerProcess(const ServerProcess&) = delete;
+        ServerProcess& operator=(const ServerProcess&) = delete;
+
+        ~ServerProcess()
+        {
+            stop();
+        }
+
+        // Run args and poll ready() until it accepts connections, throws if it exits or takes longer than 5 seconds.
+        void start(const std::vector<std::string>& args, const std::function<bool()>& ready)
+        {
+            std::vector<char*> argv;
+            for (const auto& arg : args) {
+                argv.push_back(const_cast<char*>(arg.c_str()));
+            }
+            argv.push_back(nullptr);
+            if (posix_spawn(&m_pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0) {
+                m_pid = -1;
+                throw std::runtime_error("Failed to start " + args[0]);
+            }
+
+            // wait until it accepts connections
+            for (int attempt = 0;; ++attempt) {
+                if (ready()) {
+                    break;
+                }
+                int status;
+                if (attempt == 100 || waitpid(m_pid, &status, WNOHANG) == m_pid) {
+                    stop();
+                    throw std::runtime_error(args[0] + " did not start, see its output above");
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            }
+        }
+
+        void stop()
+        {
+            if (m_pid > 0) {
+                kill(m_pid, SIGTERM);
+                waitpid(m_pid, nullptr, 0);
+                m_pid = -1;
+            }
+        }
+
+    private:
+        pid_t m_pid = -1;
+    };
+
+}
+
+#endif
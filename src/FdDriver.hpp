@@ -0,0 +1,273 @@
+// FdDriver.hpp
+
+#pragma once
+#ifndef FdDriver_HEADER
+#define FdDriver_HEADER
+
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+// boost 1.74 awaitable.hpp uses std::exchange without including <utility>
+#include <utility>
+
+#include <boost/asio.hpp>
+
+#define HANDLER_MEMORY_SIZE 512
+
+// Drives a library that does its own non-blocking IO on a file descriptor (libssh2, Xlib, ...) from asio readiness.
+namespace FdDriver {
+
+    // Readiness a library needs before its next call can make progress.
+    enum class Direction {
+        Read = 1,
+        Write = 2,
+        Both = Read | Write,
+    };
+
+    // Storage for one outstanding handler at a time, larger or concurrent handlers fall back to the heap.
+    class HandlerMemory {
+    public:
+        HandlerMemory() = default;
+        HandlerMemory(const HandlerMemory&) = delete;
+        HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+        void* allocate(std::size_t size)
+        {
+            if (!m_in_use && size <= sizeof(m_storage)) {
+                m_in_use = true;
+                return &m_storage;
+            }
+            return ::operator new(size);
+        }
+
+        void deallocate(void* pointer)
+        {
+            if (pointer == &m_storage) {
+                m_in_use = false;
+            }
+            else {
+                ::operator delete(pointer);
+            }
+        }
+
+    private:
+        alignas(std::max_align_t) unsigned char m_storage[HANDLER_MEMORY_SIZE];
+        bool m_in_use = false;
+    };
+
+    template <class T>
+    class HandlerAllocator {
+    public:
+        using value_type = T;
+
+        explicit HandlerAllocator(HandlerMemory& memory) :
+            m_memory(memory)
+        {
+        }
+
+        template <class U>
+        HandlerAllocator(const HandlerAllocator<U>& other) noexcept :
+            m_memory(other.m_memory)
+        {
+        }
+
+        T* allocate(std::size_t n) const
+        {
+            return static_cast<T*>(m_memory.allocate(sizeof(T) * n));
+        }
+
+        void deallocate(T* pointer, std::size_t) const
+        {
+            m_memory.deallocate(pointer);
+        }
+
+        bool operator==(const HandlerAllocator& other) const noexcept
+        {
+            return &m_memory == &other.m_memory;
+        }
+
+        bool operator!=(const HandlerAllocator& other) const noexcept
+        {
+            return &m_memory != &other.m_memory;
+        }
+
+    private:
+        template <class> friend class HandlerAllocator;
+
+        HandlerMemory& m_memory;
+    };
+
+    // Makes asio allocate the operation for handler from memory instead of the heap.
+    template <class Handler>
+    class CustomAllocHandler {
+    public:
+        using allocator_type = HandlerAllocator<Handler>;
+
+        CustomAllocHandler(HandlerMemory& memory, Handler handler) :
+            m_memory(memory),
+            m_handler(std::move(handler))
+        {
+        }
+
+        allocator_type get_allocator() const noexcept
+        {
+            return allocator_type(m_memory);
+        }
+
+        template <class... Args>
+        void operator()(Args&&... args)
+        {
+            m_handler(std::forward<Args>(args)...);
+        }
+
+    private:
+        HandlerMemory& m_memory;
+        Handler m_handler;
+    };
+
+    template <class Handler>
+    CustomAllocHandler<std::decay_t<Handler>> makeCustomAllocHandler(HandlerMemory& memory, Handler&& handler)
+    {
+        return CustomAllocHandler<std::decay_t<Handler>>(memory, std::forward<Handler>(handler));
+    }
+
+    // Descriptor wakeups, spurious ones found the library still unable to make progress.
+    struct WaitStats {
+        std::uint64_t wakeups = 0;
+        std::uint64_t spurious_wakeups = 0;
+    };
+
+    // Completions of a Driver without a strand run wherever the waitable's executor runs them.
+    struct NoStrand {};
+
+    // Waits on waitable (a socket, posix::stream_descriptor, ...) for whatever the library behind it needs next.
+    // Protocol describes the library:
+    //   Direction direction() const    readiness the next call needs
+    //   bool pending() const           input is already buffered in the library, the descriptor will not signal it again
+    //   bool wouldBlock(auto rc) const the call that returned rc has to be repeated once the descriptor is ready
+    // One wait is outstanding at a time and reuses the same handler memory. The driver must outlive its waits,
+    // usually by being a member of whatever the handlers keep alive.
+    template <class Protocol, class Waitable, class Strand = NoStrand>
+    class Driver {
+    public:
+        Driver(Protocol protocol, Waitable& waitable, Strand* strand = nullptr) :
+            m_protocol(std::move(protocol)),
+            m_waitable(waitable),
+            m_strand(strand)
+        {
+        }
+
+        Driver(const Driver&) = delete;
+        Driver& operator=(const Driver&) = delete;
+
+        Protocol& protocol()
+        {
+            return m_protocol;
+        }
+
+        Waitable& waitable()
+        {
+            return m_waitable;
+        }
+
+        // handler(ec) once the library can make progress, or with the error the driver failed with.
+        template <class Handler>
+        void wait(WaitStats& stats, Handler&& handler)
+        {
+            if (m_error || m_protocol.pending()) {
+                boost::asio::post(m_waitable.get_executor(), bind(makeCustomAllocHandler(m_memory, [error = m_error, handler = std::forward<Handler>(handler)]() mutable {
+                    handler(error);
+                })));
+                return;
+            }
+            Direction direction = m_protocol.direction();
+            if (direction == Direction::Both) {
+                // asio waits for one direction at a time, so wait for both and let the first completion through
+                auto state = std::make_shared<std::pair<bool, std::decay_t<Handler>>>(false, std::forward<Handler>(handler));
+                auto complete = [this, &stats, state](const boost::system::error_code& ec) {
+                    if (std::exchange(state->first, true)) {
+                        return;
+                    }
+                    boost::system::error_code ignored;
+                    m_waitable.cancel(ignored);
+                    ++stats.wakeups;
+                    state->second(m_error ? m_error : ec);
+                };
+                m_waitable.async_wait(Waitable::wait_read, bind(complete));
+                m_waitable.async_wait(Waitable::wait_write, bind(complete));
+                return;
+            }
+            auto type = direction == Direction::Write ? Waitable::wait_write : Waitable::wait_read;
+            m_waitable.async_wait(type, bind(makeCustomAllocHandler(m_memory, [this, &stats, handler = std::forward<Handler>(handler)](const boost::system::error_code& ec) mutable {
+                ++stats.wakeups;
+                handler(m_error ? m_error : ec);
+            })));
+        }
+
+        // Call operation until the protocol stops reporting wouldBlock, waiting in between, then handler(ec, rc).
+        // ec is set when a wait failed, rc is then the last would-block result.
+        template <class Operation, class Handler>
+        void retry(WaitStats& stats, Operation operation, Handler handler, bool woken = false)
+        {
+            auto rc = operation();
+            if (m_protocol.wouldBlock(rc)) {
+                if (woken) {
+                    ++stats.spurious_wakeups;
+                }
+                wait(stats, [this, &stats, rc, operation = std::move(operation), handler = std::move(handler)](const boost::system::error_code& ec) mutable {
+                    if (ec) {
+                        handler(ec, rc);
+                        return;
+                    }
+                    retry(stats, std::move(operation), std::move(handler), true);
+                });
+                return;
+            }
+            handler(boost::system::error_code(), rc);
+        }
+
+        // The outstanding wait completes with operation_aborted, later waits are unaffected.
+        void cancel()
+        {
+            boost::system::error_code ignored;
+            m_waitable.cancel(ignored);
+        }
+
+        // The outstanding wait and every later one complete with ec.
+        void fail(const boost::system::error_code& ec)
+        {
+            if (m_error) {
+                return;
+            }
+            m_error = ec;
+            cancel();
+        }
+
+        const boost::system::error_code& error() const
+        {
+            return m_error;
+        }
+
+    private:
+        Protocol m_protocol;
+        Waitable& m_waitable;
+        Strand* m_strand;
+        HandlerMemory m_memory;
+        boost::system::error_code m_error;
+
+        template <class Handler>
+        auto bind(Handler&& handler)
+        {
+            if constexpr (std::is_same_v<Strand, NoStrand>) {
+                return std::forward<Handler>(handler);
+            }
+            else {
+                return boost::asio::bind_executor(*m_strand, std::forward<Handler>(handler));
+            }
+        }
+    };
+
+}
+
+#endif
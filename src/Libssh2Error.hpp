@@ -0,0 +1,160 @@
+// Libssh2Error.hpp
+
+#pragma once
+#ifndef Libssh2Error_HEADER
+#define Libssh2Error_HEADER
+
+#include <string>
+
+#include <boost/system/error_code.hpp>
+
+#include <libssh2.h>
+#include <libssh2_sftp.h>
+
+namespace Libssh2Wrapper {
+
+    // LIBSSH2_ERROR_* return codes.
+    class Libssh2Category : public boost::system::error_category {
+    public:
+        const char* name() const noexcept override
+        {
+            return "libssh2";
+        }
+
+        std::string message(int ev) const override
+        {
+            switch (ev) {
+                case LIBSSH2_ERROR_SOCKET_NONE: return "socket error";
+                case LIBSSH2_ERROR_BANNER_RECV: return "failed to receive banner";
+                case LIBSSH2_ERROR_BANNER_SEND: return "failed to send banner";
+                case LIBSSH2_ERROR_INVALID_MAC: return "invalid MAC";
+                case LIBSSH2_ERROR_KEX_FAILURE: return "key exchange failed";
+                case LIBSSH2_ERROR_ALLOC: return "allocation failed";
+                case LIBSSH2_ERROR_SOCKET_SEND: return "failed to send on socket";
+                case LIBSSH2_ERROR_KEY_EXCHANGE_FAILURE: return "key exchange failed";
+                case LIBSSH2_ERROR_TIMEOUT: return "timed out";
+                case LIBSSH2_ERROR_HOSTKEY_INIT: return "failed to initialize host key";
+                case LIBSSH2_ERROR_HOSTKEY_SIGN: return "host key signature invalid";
+                case LIBSSH2_ERROR_DECRYPT: return "decryption failed";
+                case LIBSSH2_ERROR_SOCKET_DISCONNECT: return "disconnected";
+                case LIBSSH2_ERROR_PROTO: return "protocol error";
+                case LIBSSH2_ERROR_PASSWORD_EXPIRED: return "password expired";
+                case LIBSSH2_ERROR_FILE: return "local file error";
+                case LIBSSH2_ERROR_METHOD_NONE: return "no matching method";
+                case LIBSSH2_ERROR_AUTHENTICATION_FAILED: return "authentication failed";
+                case LIBSSH2_ERROR_PUBLICKEY_UNVERIFIED: return "public key unverified";
+                case LIBSSH2_ERROR_CHANNEL_OUTOFORDER: return "channel out of order";
+                case LIBSSH2_ERROR_CHANNEL_FAILURE: return "channel failure";
+                case LIBSSH2_ERROR_CHANNEL_REQUEST_DENIED: return "channel request denied";
+                case LIBSSH2_ERROR_CHANNEL_CLOSED: return "channel closed";
+                case LIBSSH2_ERROR_CHANNEL_EOF_SENT: return "channel EOF sent";
+                case LIBSSH2_ERROR_SCP_PROTOCOL: return "SCP protocol error";
+                case LIBSSH2_ERROR_ZLIB: return "zlib error";
+                case LIBSSH2_ERROR_SOCKET_TIMEOUT: return "socket timed out";
+                case LIBSSH2_ERROR_SFTP_PROTOCOL: return "SFTP protocol error";
+                case LIBSSH2_ERROR_REQUEST_DENIED: return "request denied";
+                case LIBSSH2_ERROR_METHOD_NOT_SUPPORTED: return "method not supported";
+                case LIBSSH2_ERROR_INVAL: return "invalid argument";
+                case LIBSSH2_ERROR_INVALID_POLL_TYPE: return "invalid poll type";
+                case LIBSSH2_ERROR_PUBLICKEY_PROTOCOL: return "public key protocol error";
+                case LIBSSH2_ERROR_EAGAIN: return "would block";
+                case LIBSSH2_ERROR_BUFFER_TOO_SMALL: return "buffer too small";
+                case LIBSSH2_ERROR_BAD_USE: return "bad use";
+                case LIBSSH2_ERROR_COMPRESS: return "compression error";
+                case LIBSSH2_ERROR_OUT_OF_BOUNDARY: return "out of boundary";
+                case LIBSSH2_ERROR_AGENT_PROTOCOL: return "agent protocol error";
+                case LIBSSH2_ERROR_SOCKET_RECV: return "failed to receive on socket";
+                case LIBSSH2_ERROR_ENCRYPT: return "encryption failed";
+                case LIBSSH2_ERROR_BAD_SOCKET: return "bad socket";
+                case LIBSSH2_ERROR_KNOWN_HOSTS: return "known hosts error";
+                default: return "libssh2 error " + std::to_string(ev);
+            }
+        }
+    };
+
+    // LIBSSH2_FX_* status codes the SFTP server answered with.
+    class SftpCategory : public boost::system::error_category {
+    public:
+        const char* name() const noexcept override
+        {
+            return "sftp";
+        }
+
+        std::string message(int ev) const override
+        {
+            switch (ev) {
+                case LIBSSH2_FX_EOF: return "end of file";
+                case LIBSSH2_FX_NO_SUCH_FILE: return "no such file";
+                case LIBSSH2_FX_PERMISSION_DENIED: return "permission denied";
+                case LIBSSH2_FX_FAILURE: return "failure";
+                case LIBSSH2_FX_BAD_MESSAGE: return "bad message";
+                case LIBSSH2_FX_NO_CONNECTION: return "no connection";
+                case LIBSSH2_FX_CONNECTION_LOST: return "connection lost";
+                case LIBSSH2_FX_OP_UNSUPPORTED: return "operation unsupported";
+                case LIBSSH2_FX_INVALID_HANDLE: return "invalid handle";
+                case LIBSSH2_FX_NO_SUCH_PATH: return "no such path";
+                case LIBSSH2_FX_FILE_ALREADY_EXISTS: return "file already exists";
+                case LIBSSH2_FX_WRITE_PROTECT: return "write protected";
+                case LIBSSH2_FX_NO_MEDIA: return "no media";
+                case LIBSSH2_FX_NO_SPACE_ON_FILESYSTEM: return "no space on filesystem";
+                case LIBSSH2_FX_QUOTA_EXCEEDED: return "quota exceeded";
+                case LIBSSH2_FX_UNKNOWN_PRINCIPAL: return "unknown principal";
+                case LIBSSH2_FX_LOCK_CONFLICT: return "lock conflict";
+                case LIBSSH2_FX_DIR_NOT_EMPTY: return "directory not empty";
+                case LIBSSH2_FX_NOT_A_DIRECTORY: return "not a directory";
+                case LIBSSH2_FX_INVALID_FILENAME: return "invalid filename";
+                case LIBSSH2_FX_LINK_LOOP: return "link loop";
+                default: return "sftp status " + std::to_string(ev);
+            }
+        }
+    };
+
+    // Errors of the library itself.
+    enum class Error {
+        ChecksumMismatch = 1,
+        UnknownFileSize,
+    };
+
+    class WrapperCategory : public boost::system::error_category {
+    public:
+        const char* name() const noexcept override
+        {
+            return "libssh2-wrapper";
+        }
+
+        std::string message(int ev) const override
+        {
+            switch (static_cast<Error>(ev)) {
+                case Error::ChecksumMismatch: return "checksum mismatch";
+                case Error::UnknownFileSize: return "remote file size is unknown";
+                default: return "libssh2-wrapper error " + std::to_string(ev);
+            }
+        }
+    };
+
+    inline const boost::system::error_category& libssh2Category()
+    {
+        static Libssh2Category category;
+        return category;
+    }
+
+    inline const boost::system::error_category& sftpCategory()
+    {
+        static SftpCategory category;
+        return category;
+    }
+
+    inline const boost::system::error_category& wrapperCategory()
+    {
+        static WrapperCategory category;
+        return category;
+    }
+
+    inline boost::system::error_code makeErrorCode(Error error)
+    {
+        return boost::system::error_code(static_cast<int>(error), wrapperCategory());
+    }
+
+}
+
+#endif
@@ -0,0 +1,2607 @@
+// Libssh2Wrapper.hpp
+
+#pragma once
+#ifndef Libssh2Wrapper_HEADER
+#define Libssh2Wrapper_HEADER
+
+#include <memory>
+#include <vector>
+#include <string>
+#include <functional>
+// boost 1.74 awaitable.hpp uses std::exchange without including <utility>
+#include <utility>
+#include <cstdlib>
+#include <cstdint>
+#include <map>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <cstddef>
+#include <type_traits>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <chrono>
+
+#include <boost/version.hpp>
+#include <boost/asio.hpp>
+#include <boost/asio/ip/tcp.hpp>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include <libssh2.h>
+#include <libssh2_sftp.h>
+
+#include <openssl/evp.h>
+
+#include "TransferStats.hpp"
+#include "Libssh2Error.hpp"
+#include "FdDriver.hpp"
+
+#define DEFAULT_READ_WINDOW 64
+#define DEFAULT_READ_CHUNK_SIZE 0x8000
+#define DEFAULT_MAX_PENDING_WRITES 4
+#define BUFFER_ALIGNMENT 0x1000
+#define DEFAULT_MAX_CACHED_BUFFERS 16
+#define FILE_IO_THREADS 2
+#define DEFAULT_WRITE_WINDOW 64
+#define DEFAULT_WRITE_CHUNK_SIZE 0x8000
+#define DEFAULT_RESUME_OVERLAP 0x10000
+#define COMPARE_BLOCK_SIZE 0x10000
+#define DIRECTORY_NAME_SIZE 1024
+#define DEFAULT_CONNECT_TIMEOUT 30000
+#define DEFAULT_DISCONNECT_TIMEOUT 5000
+#define DEFAULT_STALL_TIMEOUT 60000
+#define DEFAULT_REQUEST_TIMEOUT 30000
+
+namespace Libssh2Wrapper {
+    using boost::asio::ip::tcp;
+
+    // Aborts the transfers it is passed to through DownloadOptions::cancellation or UploadOptions::cancellation.
+    // libssh2 cannot abandon requests already sent, so a cancelled transfer tears its session down and completes
+    // with boost::asio::error::operation_aborted. Transfers started after emit() are aborted right away.
+    // Transfers on their own session (the io_context overloads) are also aborted while connecting and disconnecting,
+    // pooled transfers only once they have their session, SessionPool::acquire takes no signal.
+    // emit() may be called from any thread.
+    class CancellationSignal {
+    public:
+        void emit()
+        {
+            std::map<std::uint64_t, std::function<void()>> slots;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_emitted = true;
+                slots.swap(m_slots);
+            }
+            for (auto& [id, slot] : slots) {
+                slot();
+            }
+        }
+
+        bool emitted() const
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_emitted;
+        }
+
+        // Returns an id for disconnect, slot runs on the thread calling emit().
+        std::uint64_t connect(std::function<void()> slot)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            std::uint64_t id = ++m_next_id;
+            if (m_emitted) {
+                lock.unlock();
+                slot();
+                return id;
+            }
+            m_slots.emplace(id, std::move(slot));
+            return id;
+        }
+
+        void disconnect(std::uint64_t id)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_slots.erase(id);
+        }
+
+    private:
+        mutable std::mutex m_mutex;
+        std::map<std::uint64_t, std::function<void()>> m_slots;
+        std::uint64_t m_next_id = 0;
+        bool m_emitted = false;
+    };
+
+    struct DownloadOptions {
+        // The read-ahead buffer is read_window * read_chunk_size bytes. libssh2 splits each libssh2_sftp_read()
+        // into requests of at most 30000 bytes on its own and reads ahead in proportion to the buffer it is given,
+        // so only the product matters: it is the buffer size, not a request count or a request size.
+        std::size_t read_window = DEFAULT_READ_WINDOW;
+        std::size_t read_chunk_size = DEFAULT_READ_CHUNK_SIZE;
+        // Number of filled buffers handed to the sink before reading pauses.
+        std::size_t max_pending_writes = DEFAULT_MAX_PENDING_WRITES;
+        // Open the destination with O_DIRECT, only used when downloading to a path.
+        bool direct_io = false;
+        // Number of ranges downloadFileSegmented fetches concurrently, each over its own session on the same io_context.
+        std::size_t segments = 4;
+        // Continue a partial destination file instead of starting over, only used when downloading to a path.
+        bool resume = false;
+        // Bytes before the resume point fetched again and compared, a mismatch restarts the download from zero.
+        std::size_t resume_overlap = DEFAULT_RESUME_OVERLAP;
+        // Hex SHA-256 the finished destination file must have, empty to skip the check.
+        std::string expected_sha256;
+        // Deadline for opening, reading and closing the remote file, zero for none.
+        std::chrono::milliseconds timeout{0};
+        // Fail the transfer if no data arrives for this long, zero to wait forever. Time spent paused for a slow sink does not count.
+        std::chrono::milliseconds stall_timeout{DEFAULT_STALL_TIMEOUT};
+        std::shared_ptr<CancellationSignal> cancellation;
+    };
+
+    struct MirrorOptions {
+        // Directories listed concurrently, each over its own session.
+        std::size_t listing_sessions = 4;
+        // Files downloaded concurrently, each over its own session.
+        std::size_t download_sessions = 8;
+        DownloadOptions download;
+    };
+
+    struct MirrorStats {
+        std::uint64_t directories = 0;
+        std::uint64_t files_downloaded = 0;
+        std::uint64_t files_skipped = 0;
+        std::uint64_t bytes_downloaded = 0;
+        // failures do not stop the mirror, the handler gets the first error
+        std::uint64_t directories_failed = 0;
+        std::uint64_t files_failed = 0;
+    };
+
+    struct SessionOptions {
+        std::string port = "22";
+        // Authenticate with this key instead of a password, the password is then the key passphrase.
+        std::string private_key_path;
+        // Optional, libssh2 derives the public key from the private key if this is empty.
+        std::string public_key_path;
+        // Deadline for resolving through SFTP init, zero for none.
+        std::chrono::milliseconds connect_timeout{DEFAULT_CONNECT_TIMEOUT};
+        // Deadline for shutting down SFTP and the session, the session is then freed without a goodbye.
+        std::chrono::milliseconds disconnect_timeout{DEFAULT_DISCONNECT_TIMEOUT};
+        // Deadline for a stat, and for each batch of names while listing a directory, zero for none.
+        std::chrono::milliseconds request_timeout{DEFAULT_REQUEST_TIMEOUT};
+        // Comma separated preferences for libssh2_session_method_pref(), empty keeps libssh2's order.
+        // AEAD ciphers (aes128-gcm@openssh.com, chacha20-poly1305@openssh.com) bring their own MAC.
+        std::string kex_methods;
+        std::string cipher_methods;
+        std::string mac_methods;
+        // Offer zlib compression, pays off for compressible data on links slower than the CPU.
+        bool compress = false;
+        // Called after the handshake with the 20 byte SHA-1 of the server's host key, e.g. to print or check it.
+        std::function<void(const std::string&)> host_key_handler;
+    };
+
+    struct UploadOptions {
+        // Number of SFTP write requests to keep in flight.
+        std::size_t write_window = DEFAULT_WRITE_WINDOW;
+        // Size of each write request, libssh2 caps a single request at ~30000 bytes.
+        std::size_t write_chunk_size = DEFAULT_WRITE_CHUNK_SIZE;
+        // Permissions of the remote file if it is created.
+        long mode = 0644;
+        // Deadline for opening, writing and closing the remote file, zero for none.
+        std::chrono::milliseconds timeout{0};
+        // Fail the upload if the server acknowledges nothing for this long, zero to wait forever.
+        std::chrono::milliseconds stall_timeout{DEFAULT_STALL_TIMEOUT};
+        std::shared_ptr<CancellationSignal> cancellation;
+    };
+
+    struct BufferPoolStats {
+        std::uint64_t allocations = 0;
+        std::uint64_t hits = 0;
+        // released buffers freed because their size already had max_cached free buffers, only counted by the pool
+        std::uint64_t frees = 0;
+    };
+
+    class BufferPool;
+
+    // Fixed-size, BUFFER_ALIGNMENT aligned I/O buffer that returns to its pool when destroyed.
+    class PooledBuffer {
+    public:
+        PooledBuffer() = default;
+        PooledBuffer(BufferPool* pool, char* data, std::size_t size) :
+            m_pool(pool),
+            m_data(data),
+            m_size(size)
+        {
+        }
+        PooledBuffer(PooledBuffer&& other) noexcept :
+            m_pool(std::exchange(other.m_pool, nullptr)),
+            m_data(std::exchange(other.m_data, nullptr)),
+            m_size(std::exchange(other.m_size, 0))
+        {
+        }
+        PooledBuffer& operator=(PooledBuffer&& other) noexcept
+        {
+            if (this != &other) {
+                reset();
+                m_pool = std::exchange(other.m_pool, nullptr);
+                m_data = std::exchange(other.m_data, nullptr);
+                m_size = std::exchange(other.m_size, 0);
+            }
+            return *this;
+        }
+        PooledBuffer(const PooledBuffer&) = delete;
+        PooledBuffer& operator=(const PooledBuffer&) = delete;
+        ~PooledBuffer()
+        {
+            reset();
+        }
+
+        char* data() const { return m_data; }
+        std::size_t size() const { return m_size; }
+
+        void reset();
+
+    private:
+        BufferPool* m_pool = nullptr;
+        char* m_data = nullptr;
+        std::size_t m_size = 0;
+    };
+
+    // One pool per io_context, obtained with boost::asio::use_service<BufferPool>(ioc).
+    // Buffers are kept in free lists per size, so steady state transfers do not allocate. Each list keeps at most
+    // max_cached buffers, what a burst of transfers allocated beyond that is freed as it comes back.
+    class BufferPool : public boost::asio::execution_context::service {
+    public:
+        inline static boost::asio::execution_context::id id;
+
+        explicit BufferPool(boost::asio::execution_context& ctx) :
+            boost::asio::execution_context::service(ctx)
+        {
+        }
+
+        ~BufferPool()
+        {
+            for (auto& [size, buffers] : m_free) {
+                for (char* buffer : buffers) {
+                    std::free(buffer);
+                }
+            }
+        }
+
+        PooledBuffer acquire(std::size_t size, BufferPoolStats& stats)
+        {
+            // aligned_alloc requires the size to be a multiple of the alignment
+            size = (size + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                auto& buffers = m_free[size];
+                if (!buffers.empty()) {
+                    char* buffer = buffers.back();
+                    buffers.pop_back();
+                    ++m_stats.hits;
+                    ++stats.hits;
+                    return PooledBuffer(this, buffer, size);
+                }
+                ++m_stats.allocations;
+                ++stats.allocations;
+            }
+            char* buffer = static_cast<char*>(std::aligned_alloc(BUFFER_ALIGNMENT, size));
+            if (!buffer) {
+                throw std::bad_alloc();
+            }
+            return PooledBuffer(this, buffer, size);
+        }
+
+        void release(char* buffer, std::size_t size)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                auto& buffers = m_free[size];
+                if (buffers.size() < m_max_cached) {
+                    buffers.push_back(buffer);
+                    return;
+                }
+                ++m_stats.frees;
+            }
+            std::free(buffer);
+        }
+
+        // Free buffers kept per size, DEFAULT_MAX_CACHED_BUFFERS unless set. Lowering it frees the excess right away.
+        void setMaxCached(std::size_t max_cached)
+        {
+            std::vector<char*> excess;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_max_cached = max_cached;
+                for (auto& [size, buffers] : m_free) {
+                    while (buffers.size() > m_max_cached) {
+                        excess.push_back(buffers.back());
+                        buffers.pop_back();
+                        ++m_stats.frees;
+                    }
+                }
+            }
+            for (char* buffer : excess) {
+                std::free(buffer);
+            }
+        }
+
+        BufferPoolStats stats()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_stats;
+        }
+
+    private:
+        void shutdown() override
+        {
+        }
+
+        std::mutex m_mutex;
+        std::map<std::size_t, std::vector<char*>> m_free;
+        std::size_t m_max_cached = DEFAULT_MAX_CACHED_BUFFERS;
+        BufferPoolStats m_stats;
+    };
+
+    inline void PooledBuffer::reset()
+    {
+        if (m_pool) {
+            m_pool->release(m_data, m_size);
+        }
+        m_pool = nullptr;
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    // Destination for downloaded data. Writes are positioned, so a sink must accept them in any order.
+    class Sink {
+    public:
+        using Handler = std::function<void(const boost::system::error_code&)>;
+
+        virtual ~Sink() = default;
+
+        // Write buffer.data()[0, size) at offset. The sink owns the buffer until handler is invoked.
+        virtual void asyncWrite(std::uint64_t offset, PooledBuffer buffer, std::size_t size, Handler handler) = 0;
+
+        // Called once after every write has completed, size is the final size of the file.
+        virtual void asyncClose(std::uint64_t size, Handler handler) = 0;
+    };
+
+    // Thread pool that runs blocking file calls off the io_context threads, one per io_context.
+    class FileIoService : public boost::asio::execution_context::service {
+    public:
+        inline static boost::asio::execution_context::id id;
+
+        explicit FileIoService(boost::asio::execution_context& ctx) :
+            boost::asio::execution_context::service(ctx),
+            m_pool(FILE_IO_THREADS)
+        {
+        }
+
+        boost::asio::thread_pool& pool()
+        {
+            return m_pool;
+        }
+
+    private:
+        void shutdown() override
+        {
+            m_pool.stop();
+            m_pool.join();
+        }
+
+        boost::asio::thread_pool m_pool;
+    };
+
+    // Writes with pwrite() on the FileIoService pool and completes on the io_context.
+    // With direct_io the file is opened with O_DIRECT so large downloads bypass the page cache.
+    class FileSink : public Sink {
+    public:
+        FileSink(boost::asio::io_context& ioc, const std::string& path, bool direct_io = false, bool truncate = true) :
+            m_ioc(ioc),
+            m_direct_io(direct_io)
+        {
+            boost::system::error_code ec;
+            open(path, truncate, ec);
+            if (ec) {
+                throw boost::system::system_error(ec, "Failed to open destination file");
+            }
+        }
+
+        // Non-throwing form for use inside handlers, the sink is unusable if ec is set.
+        FileSink(boost::asio::io_context& ioc, const std::string& path, bool direct_io, bool truncate, boost::system::error_code& ec) :
+            m_ioc(ioc),
+            m_direct_io(direct_io)
+        {
+            open(path, truncate, ec);
+        }
+
+        ~FileSink()
+        {
+            if (m_fd >= 0) {
+                ::close(m_fd);
+            }
+        }
+
+        void asyncWrite(std::uint64_t offset, PooledBuffer buffer, std::size_t size, Handler handler) override
+        {
+            // O_DIRECT requires block aligned lengths, pool buffers are padded so the tail is written whole and truncated on close
+            std::size_t length = m_direct_io ? (size + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT : size;
+            auto work = boost::asio::prefer(m_ioc.get_executor(), boost::asio::execution::outstanding_work.tracked);
+            boost::asio::post(boost::asio::use_service<FileIoService>(m_ioc).pool(), [fd = m_fd, offset, length, buffer = std::move(buffer), handler = std::move(handler), work]() mutable {
+                boost::system::error_code ec;
+                std::size_t written = 0;
+                while (written < length) {
+                    ssize_t rc = ::pwrite(fd, buffer.data() + written, length - written, offset + written);
+                    if (rc < 0) {
+                        if (errno == EINTR) {
+                            continue;
+                        }
+                        ec.assign(errno, boost::system::system_category());
+                        break;
+                    }
+                    written += rc;
+                }
+                buffer.reset();
+                boost::asio::post(work, [handler = std::move(handler), ec]() {
+                    handler(ec);
+                });
+            });
+        }
+
+        void asyncClose(std::uint64_t size, Handler handler) override
+        {
+            auto work = boost::asio::prefer(m_ioc.get_executor(), boost::asio::execution::outstanding_work.tracked);
+            boost::asio::post(boost::asio::use_service<FileIoService>(m_ioc).pool(), [fd = std::exchange(m_fd, -1), size, direct_io = m_direct_io, handler = std::move(handler), work]() {
+                boost::system::error_code ec;
+                if (direct_io && ::ftruncate(fd, size) < 0) {
+                    ec.assign(errno, boost::system::system_category());
+                }
+                if (::close(fd) < 0 && !ec) {
+                    ec.assign(errno, boost::system::system_category());
+                }
+                boost::asio::post(work, [handler = std::move(handler), ec]() {
+                    handler(ec);
+                });
+            });
+        }
+
+    private:
+        void open(const std::string& path, bool truncate, boost::system::error_code& ec)
+        {
+            int flags = O_WRONLY | O_CREAT;
+            if (truncate) {
+                flags |= O_TRUNC;
+            }
+            if (m_direct_io) {
+#ifdef O_DIRECT
+                flags |= O_DIRECT;
+#else
+                ec = boost::asio::error::operation_not_supported;
+                return;
+#endif
+            }
+            m_fd = ::open(path.c_str(), flags, 0644);
+            if (m_fd < 0) {
+                ec.assign(errno, boost::system::system_category());
+            }
+        }
+
+        boost::asio::io_context& m_ioc;
+        bool m_direct_io;
+        int m_fd = -1;
+    };
+
+    // Read-only mapping of a local file, so uploads send straight from the page cache.
+    class MappedFile {
+    public:
+        explicit MappedFile(const std::string& path)
+        {
+            boost::system::error_code ec;
+            map(path, ec);
+            if (ec) {
+                throw boost::system::system_error(ec, "Failed to map source file");
+            }
+        }
+
+        // Non-throwing form for use inside handlers, the mapping is empty if ec is set.
+        MappedFile(const std::string& path, boost::system::error_code& ec)
+        {
+            map(path, ec);
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile()
+        {
+            if (m_data) {
+                ::munmap(const_cast<char*>(m_data), m_size);
+            }
+        }
+
+        const char* data() const { return m_data; }
+        std::size_t size() const { return m_size; }
+
+    private:
+        void map(const std::string& path, boost::system::error_code& ec)
+        {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                ec.assign(errno, boost::system::system_category());
+                return;
+            }
+            struct stat st;
+            if (::fstat(fd, &st) < 0) {
+                ec.assign(errno, boost::system::system_category());
+                ::close(fd);
+                return;
+            }
+            m_size = static_cast<std::size_t>(st.st_size);
+            if (m_size > 0) {
+                void* data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data == MAP_FAILED) {
+                    ec.assign(errno, boost::system::system_category());
+                    m_size = 0;
+                    ::close(fd);
+                    return;
+                }
+                ::madvise(data, m_size, MADV_SEQUENTIAL);
+                m_data = static_cast<const char*>(data);
+            }
+            ::close(fd);
+        }
+
+        const char* m_data = nullptr;
+        std::size_t m_size = 0;
+    };
+
+    // Hex SHA-256 of a whole file, empty if it could not be read.
+    inline std::string sha256File(const std::string& path)
+    {
+        boost::system::error_code ec;
+        MappedFile file(path, ec);
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int length = 0;
+        if (ec || !EVP_Digest(file.data() ? file.data() : "", file.size(), digest, &length, EVP_sha256(), nullptr)) {
+            return std::string();
+        }
+        std::string hex;
+        for (unsigned int i = 0; i < length; ++i) {
+            char byte[3];
+            std::snprintf(byte, sizeof(byte), "%02x", digest[i]);
+            hex += byte;
+        }
+        return hex;
+    }
+
+    namespace impl {
+
+        using FdDriver::WaitStats;
+
+        // A libssh2 session as FdDriver sees it, calls return LIBSSH2_ERROR_EAGAIN until the socket is ready.
+        struct SessionProtocol {
+            LIBSSH2_SESSION* const* session;
+
+            FdDriver::Direction direction() const {
+                int directions = libssh2_session_block_directions(*session);
+                if (directions == (LIBSSH2_SESSION_BLOCK_INBOUND | LIBSSH2_SESSION_BLOCK_OUTBOUND)) {
+                    return FdDriver::Direction::Both;
+                }
+                return (directions & LIBSSH2_SESSION_BLOCK_OUTBOUND) ? FdDriver::Direction::Write : FdDriver::Direction::Read;
+            }
+
+            bool pending() const {
+                return false;
+            }
+
+            bool wouldBlock(int rc) const {
+                return rc == LIBSSH2_ERROR_EAGAIN;
+            }
+        };
+
+        using SessionDriver = FdDriver::Driver<SessionProtocol, tcp::socket>;
+
+        // An authenticated SSH session with an SFTP subsystem, reusable by consecutive transfers.
+        struct Connection {
+            std::unique_ptr<tcp::resolver> resolver;
+            std::unique_ptr<tcp::socket> socket;
+            LIBSSH2_SESSION* session = nullptr;
+            LIBSSH2_SFTP* sftp_session = nullptr;
+            std::string target_host;
+            std::string username;
+            std::string password;
+            SessionOptions options;
+            // waits for libssh2 on socket, only one is outstanding per session at a time
+            std::unique_ptr<SessionDriver> driver;
+            // waits made while connecting and disconnecting
+            WaitStats wait_stats;
+            PhaseTimeline timeline;
+            // set once a socket or libssh2 error left the session unusable, it is then torn down instead of reused
+            bool failed = false;
+            // set by a deadline or cancellation, every later step of the session fails with it
+            boost::system::error_code abort_error;
+            // see armDeadline, null for sessions without deadlines
+            std::unique_ptr<boost::asio::steady_timer> deadline;
+            std::chrono::steady_clock::time_point deadline_at = std::chrono::steady_clock::time_point::max();
+            std::chrono::steady_clock::duration stall_timeout{0};
+            std::chrono::steady_clock::time_point last_progress;
+            // set while a download waits for its sink, a slow disk is not a stalled peer
+            bool stall_suspended = false;
+
+            std::function<void(const boost::system::error_code&)> handler;
+
+            ~Connection() {
+                // forced teardown of a session that was never disconnected, with the socket shut down
+                // libssh2 cannot block and fails whatever it still tries to send
+                if (socket) {
+                    boost::system::error_code ignored;
+                    socket->shutdown(tcp::socket::shutdown_both, ignored);
+                }
+                if (sftp_session) {
+                    libssh2_sftp_shutdown(sftp_session);
+                }
+                if (session) {
+                    libssh2_session_free(session);
+                }
+            }
+        };
+
+        // Error for a libssh2 return code. SFTP status codes from the server leave the session usable, anything else fails it.
+        inline boost::system::error_code sessionError(Connection& connection, int rc) {
+            if (rc == 0) {
+                return boost::system::error_code();
+            }
+            if (rc == LIBSSH2_ERROR_SFTP_PROTOCOL && connection.sftp_session) {
+                unsigned long status = libssh2_sftp_last_error(connection.sftp_session);
+                // the call failed even if no status was recorded, LIBSSH2_FX_OK must not read as success
+                return boost::system::error_code(status == LIBSSH2_FX_OK ? LIBSSH2_FX_FAILURE : static_cast<int>(status), sftpCategory());
+            }
+            connection.failed = true;
+            return boost::system::error_code(rc, libssh2Category());
+        }
+
+        // Error of a step that completed with ec, the abort reason once the session was aborted.
+        inline boost::system::error_code stepError(const Connection& connection, const boost::system::error_code& ec) {
+            return connection.abort_error ? connection.abort_error : ec;
+        }
+
+        // Fail the session with ec, whatever it is waiting for completes with ec and the session is torn down.
+        inline void abortConnection(Connection& connection, const boost::system::error_code& ec) {
+            if (connection.abort_error) {
+                return;
+            }
+            connection.abort_error = ec;
+            connection.failed = true;
+            if (connection.resolver) {
+                connection.resolver->cancel();
+            }
+            if (connection.driver) {
+                connection.driver->fail(ec);
+            }
+        }
+
+        inline void checkDeadline(std::shared_ptr<Connection> connection) {
+            auto due = connection->deadline_at;
+            if (connection->stall_timeout.count() > 0 && !connection->stall_suspended) {
+                due = std::min(due, connection->last_progress + connection->stall_timeout);
+            }
+            if (due == std::chrono::steady_clock::time_point::max()) {
+                return;
+            }
+            if (std::chrono::steady_clock::now() >= due) {
+                abortConnection(*connection, boost::asio::error::timed_out);
+                return;
+            }
+            // progress only moves last_progress, the timer catches up when it fires
+            connection->deadline->expires_at(due);
+            connection->deadline->async_wait([weak = std::weak_ptr<Connection>(connection)](const boost::system::error_code& ec) {
+                auto connection = weak.lock();
+                if (!ec && connection) {
+                    checkDeadline(std::move(connection));
+                }
+            });
+        }
+
+        // Abort the session with timed_out after timeout, or once nothing marks progress for stall_timeout. Zero disables either.
+        inline void armDeadline(std::shared_ptr<Connection> connection, std::chrono::milliseconds timeout, std::chrono::milliseconds stall_timeout = std::chrono::milliseconds(0)) {
+            if (!connection->deadline || connection->abort_error) {
+                return;
+            }
+            auto now = std::chrono::steady_clock::now();
+            connection->deadline_at = timeout.count() > 0 ? now + timeout : std::chrono::steady_clock::time_point::max();
+            connection->stall_timeout = stall_timeout;
+            connection->stall_suspended = false;
+            connection->last_progress = now;
+            checkDeadline(std::move(connection));
+        }
+
+        inline void disarmDeadline(Connection& connection) {
+            if (!connection.deadline) {
+                return;
+            }
+            connection.deadline_at = std::chrono::steady_clock::time_point::max();
+            connection.stall_timeout = std::chrono::steady_clock::duration(0);
+            connection.stall_suspended = false;
+            connection.deadline->cancel();
+        }
+
+        // Throws for options no transfer can run with. The public entry points call these before connecting,
+        // so a bad job fails where it is started instead of inside io_context::run().
+        inline void validateOptions(const DownloadOptions& options) {
+            if (options.read_window == 0 || options.read_chunk_size == 0) {
+                throw std::invalid_argument("Read window and chunk size must be non-zero");
+            }
+            if (options.max_pending_writes == 0) {
+                // reading would pause with no write left to resume it
+                throw std::invalid_argument("Max pending writes must be non-zero");
+            }
+        }
+
+        inline void validateOptions(const UploadOptions& options) {
+            if (options.write_window == 0 || options.write_chunk_size == 0) {
+                throw std::invalid_argument("Write window and chunk size must be non-zero");
+            }
+        }
+
+        // Abort connection when signal is emitted, from resolving through teardown. Returns the id for
+        // disconnectCancellation, 0 without a signal.
+        inline std::uint64_t connectCancellation(const std::shared_ptr<CancellationSignal>& signal, const std::shared_ptr<Connection>& connection) {
+            if (!signal) {
+                return 0;
+            }
+            return signal->connect([weak = std::weak_ptr<Connection>(connection), executor = connection->socket->get_executor()]() {
+                // emit() may run on another thread
+                boost::asio::post(executor, [weak]() {
+                    if (auto connection = weak.lock()) {
+                        abortConnection(*connection, boost::asio::error::operation_aborted);
+                    }
+                });
+            });
+        }
+
+        inline void disconnectCancellation(const std::shared_ptr<CancellationSignal>& signal, std::uint64_t slot) {
+            if (slot) {
+                signal->disconnect(slot);
+            }
+        }
+
+        // Abort the session of context while it runs when its options.cancellation is emitted.
+        template <class TransferContext>
+        void connectCancellation(const std::shared_ptr<TransferContext>& context) {
+            const auto& signal = context->options.cancellation;
+            if (!signal) {
+                return;
+            }
+            context->cancellation_slot = signal->connect([weak = std::weak_ptr<TransferContext>(context), executor = context->connection->socket->get_executor()]() {
+                // emit() may run on another thread
+                boost::asio::post(executor, [weak]() {
+                    auto context = weak.lock();
+                    if (context && context->cancellation_slot) {
+                        abortConnection(*context->connection, boost::asio::error::operation_aborted);
+                    }
+                });
+            });
+        }
+
+        template <class TransferContext>
+        void disconnectCancellation(TransferContext& context) {
+            if (context.cancellation_slot) {
+                context.options.cancellation->disconnect(std::exchange(context.cancellation_slot, 0));
+            }
+        }
+
+        struct Context {
+            std::shared_ptr<Connection> connection;
+            LIBSSH2_SFTP_HANDLE* sftp_handle = nullptr;
+            std::string target_path;
+            std::shared_ptr<Sink> sink;
+            DownloadOptions options;
+            // libssh2_sftp_read() sends read-ahead requests in proportion to the buffer it is given
+            // and returns the data in file order, so the read window is expressed as the buffer size.
+            PooledBuffer read_buffer;
+            std::size_t read_filled = 0;
+            // full buffers are handed to the sink and replaced from the pool
+            BufferPool* buffer_pool = nullptr;
+            // buffer allocations and pool hits made on behalf of this transfer
+            BufferPoolStats buffer_stats;
+            // the transfer covers [write_offset, read_end) of the remote file
+            std::uint64_t write_offset = 0;
+            std::uint64_t read_end = std::numeric_limits<std::uint64_t>::max();
+            std::size_t pending_writes = 0;
+            bool receive_paused = false;
+            bool receive_done = false;
+            bool receive_woken = false;
+            // waits made while opening, reading and closing the remote file
+            WaitStats wait_stats;
+            PhaseTimeline timeline;
+            std::uint64_t bytes_received = 0;
+            // first error of the transfer, reading stops and the handler gets it once the sink and handle are closed
+            boost::system::error_code error;
+            // id in options.cancellation while the transfer runs
+            std::uint64_t cancellation_slot = 0;
+            // false for the resume check of startFileDownload, which is part of the download that follows it
+            bool record_stats = true;
+
+            std::function<void(const boost::system::error_code&)> handler;
+        };
+
+        // Wait until libssh2 can make progress on the session, in the direction libssh2_session_block_directions() reports.
+        template <class Handler>
+        void waitSession(Connection& connection, WaitStats& stats, Handler&& handler) {
+            connection.driver->wait(stats, std::forward<Handler>(handler));
+        }
+
+        // Call operation until it stops returning LIBSSH2_ERROR_EAGAIN, waiting for libssh2 in between, then handler(ec).
+        template <class Operation, class Handler>
+        void asyncRetry(std::shared_ptr<Connection> connection, WaitStats& stats, Operation operation, Handler handler) {
+            SessionDriver& driver = *connection->driver;
+            driver.retry(stats, std::move(operation), [connection = std::move(connection), handler = std::move(handler)](const boost::system::error_code& ec, int rc) mutable {
+                if (ec) {
+                    connection->failed = true;
+                    handler(ec);
+                    return;
+                }
+                handler(sessionError(*connection, rc));
+            });
+        }
+
+        inline void finishDisconnect(std::shared_ptr<Connection> connection) {
+            disarmDeadline(*connection);
+            connection->timeline.end(Phase::Disconnect);
+            TransferStats::global().recordWaits(connection->wait_stats.wakeups, connection->wait_stats.spurious_wakeups);
+            connection->handler(boost::system::error_code());
+        }
+
+        // Shut down SFTP and the session, a failed session is left to the destructor. Teardown errors are not reported.
+        // A peer that does not answer within options.disconnect_timeout fails the session, so teardown always ends.
+        inline void doDisconnect(std::shared_ptr<Connection> connection) {
+            connection->timeline.begin(Phase::Disconnect);
+            if (connection->failed) {
+                finishDisconnect(connection);
+                return;
+            }
+            armDeadline(connection, connection->options.disconnect_timeout);
+            asyncRetry(connection, connection->wait_stats, [connection]() {
+                return libssh2_sftp_shutdown(connection->sftp_session);
+            }, [connection](const boost::system::error_code& ec) {
+                connection->sftp_session = nullptr;
+                if (connection->failed) {
+                    finishDisconnect(connection);
+                    return;
+                }
+                asyncRetry(connection, connection->wait_stats, [connection]() {
+                    return libssh2_session_disconnect(connection->session, "Normal Shutdown");
+                }, [connection](const boost::system::error_code& ec) {
+                    if (connection->failed) {
+                        finishDisconnect(connection);
+                        return;
+                    }
+                    asyncRetry(connection, connection->wait_stats, [connection]() {
+                        return libssh2_session_free(connection->session);
+                    }, [connection](const boost::system::error_code& ec) {
+                        if (!ec) {
+                            connection->session = nullptr;
+                        }
+                        finishDisconnect(connection);
+                    });
+                });
+            });
+        }
+
+        inline void finishTransfer(std::shared_ptr<Context> context) {
+            disconnectCancellation(*context);
+            disarmDeadline(*context->connection);
+            context->timeline.end(Phase::Close);
+            auto& stats = TransferStats::global();
+            stats.recordWaits(context->wait_stats.wakeups, context->wait_stats.spurious_wakeups);
+            if (!context->error && context->record_stats) {
+                stats.recordDownload(context->bytes_received, context->timeline.duration(Phase::Transfer));
+            }
+            context->handler(context->error);
+        }
+
+        inline void doCleanup(std::shared_ptr<Context> context) {
+            // the session stays open for the next transfer
+            context->timeline.begin(Phase::Close);
+            if (!context->sftp_handle || context->connection->failed) {
+                // a failed session is torn down with the handle
+                context->sftp_handle = nullptr;
+                finishTransfer(context);
+                return;
+            }
+            asyncRetry(context->connection, context->wait_stats, [context]() {
+                return libssh2_sftp_close(context->sftp_handle);
+            }, [context](const boost::system::error_code& ec) {
+                context->sftp_handle = nullptr;
+                if (ec && !context->error) {
+                    context->error = ec;
+                }
+                finishTransfer(context);
+            });
+        }
+
+        inline void doCloseSink(std::shared_ptr<Context> context) {
+            context->sink->asyncClose(context->write_offset, [context](const boost::system::error_code& ec) {
+                if (ec && !context->error) {
+                    context->error = ec;
+                }
+                doCleanup(context);
+            });
+        }
+
+        // Stop reading, the sink is closed once the writes in flight complete.
+        inline void finishReceive(std::shared_ptr<Context> context) {
+            context->receive_done = true;
+            context->read_buffer.reset();
+            if (context->pending_writes == 0) {
+                doCloseSink(context);
+            }
+        }
+
+        inline void doReceiveFile(std::shared_ptr<Context> context);
+
+        inline void bufferWritten(std::shared_ptr<Context> context, const boost::system::error_code& ec) {
+            if (ec && !context->error) {
+                context->error = ec;
+            }
+            --context->pending_writes;
+            if (context->receive_done) {
+                if (context->pending_writes == 0) {
+                    doCloseSink(context);
+                }
+            }
+            else if (context->receive_paused) {
+                context->receive_paused = false;
+                // the stall clock starts over now that reading goes on
+                auto& connection = context->connection;
+                connection->stall_suspended = false;
+                connection->last_progress = std::chrono::steady_clock::now();
+                if (connection->deadline) {
+                    checkDeadline(connection);
+                }
+                doReceiveFile(context);
+            }
+            // otherwise a wait is outstanding and the next doReceiveFile sees the error
+        }
+
+        inline void submitReadBuffer(std::shared_ptr<Context> context) {
+            std::uint64_t offset = context->write_offset;
+            std::size_t size = std::exchange(context->read_filled, 0);
+            context->write_offset += size;
+            ++context->pending_writes;
+            context->sink->asyncWrite(offset, std::move(context->read_buffer), size, [context](const boost::system::error_code& ec) {
+                bufferWritten(context, ec);
+            });
+        }
+
+        inline void doReceiveFile(std::shared_ptr<Context> context) {
+            for (;;) {
+                if (context->connection->abort_error && !context->error) {
+                    // aborted while reading was paused for the sink
+                    context->error = context->connection->abort_error;
+                }
+                if (context->error) {
+                    finishReceive(context);
+                    return;
+                }
+                std::uint64_t remaining = context->read_end - (context->write_offset + context->read_filled);
+                if (!context->read_buffer.data() && remaining > 0) {
+                    if (context->pending_writes >= context->options.max_pending_writes) {
+                        // the sink is behind, resume once a write completes
+                        context->receive_paused = true;
+                        context->connection->stall_suspended = true;
+                        return;
+                    }
+                    context->read_buffer = context->buffer_pool->acquire(context->options.read_window * context->options.read_chunk_size, context->buffer_stats);
+                }
+                auto& buffer = context->read_buffer;
+                ssize_t rc = 0;
+                if (remaining > 0) {
+                    std::size_t size = std::min<std::uint64_t>(buffer.size() - context->read_filled, remaining);
+                    rc = libssh2_sftp_read(context->sftp_handle, buffer.data() + context->read_filled, size);
+                }
+                if (rc > 0) {
+                    // short reads are normal while the pipeline fills, only rc == 0 means end of file
+                    context->receive_woken = false;
+                    context->connection->last_progress = std::chrono::steady_clock::now();
+                    context->read_filled += rc;
+                    context->bytes_received += rc;
+                    if (context->read_filled == buffer.size() || static_cast<std::uint64_t>(rc) == remaining) {
+                        submitReadBuffer(context);
+                    }
+                }
+                else if (rc == 0) {
+                    // done receiving file or range
+                    context->timeline.end(Phase::Transfer);
+                    if (context->read_filled > 0) {
+                        submitReadBuffer(context);
+                    }
+                    finishReceive(context);
+                    return;
+                }
+                else if (rc == LIBSSH2_ERROR_EAGAIN) {
+                    if (context->receive_woken) {
+                        ++context->wait_stats.spurious_wakeups;
+                    }
+                    waitSession(*context->connection, context->wait_stats, [context](const boost::system::error_code& ec) {
+                        if (ec) {
+                            context->connection->failed = true;
+                            if (!context->error) {
+                                context->error = ec;
+                            }
+                        }
+                        context->receive_woken = true;
+                        doReceiveFile(context);
+                    });
+                    return;
+                }
+                else {
+                    context->error = sessionError(*context->connection, static_cast<int>(rc));
+                    finishReceive(context);
+                    return;
+                }
+            }
+        }
+
+        inline void doOpenFile(std::shared_ptr<Context> context) {
+            context->timeline.begin(Phase::Open);
+            asyncRetry(context->connection, context->wait_stats, [context]() {
+                auto& connection = *context->connection;
+                context->sftp_handle = libssh2_sftp_open(connection.sftp_session, context->target_path.c_str(), LIBSSH2_FXF_READ, 0);
+                return context->sftp_handle ? 0 : libssh2_session_last_errno(connection.session);
+            }, [context](const boost::system::error_code& ec) {
+                if (ec) {
+                    context->error = ec;
+                    finishReceive(context);
+                    return;
+                }
+                context->timeline.end(Phase::Open);
+                context->timeline.begin(Phase::Transfer);
+                if (context->write_offset > 0) {
+                    libssh2_sftp_seek64(context->sftp_handle, context->write_offset);
+                }
+                doReceiveFile(context);
+            });
+        }
+
+        // Report a failed connection attempt, the destructor frees whatever was set up.
+        inline void failConnection(std::shared_ptr<Connection> connection, const boost::system::error_code& ec) {
+            connection->failed = true;
+            disarmDeadline(*connection);
+            connection->handler(stepError(*connection, ec));
+        }
+
+        inline void doSFTPInit(std::shared_ptr<Connection> connection) {
+            connection->timeline.begin(Phase::SftpInit);
+            asyncRetry(connection, connection->wait_stats, [connection]() {
+                connection->sftp_session = libssh2_sftp_init(connection->session);
+                return connection->sftp_session ? 0 : libssh2_session_last_errno(connection->session);
+            }, [connection](const boost::system::error_code& ec) {
+                if (ec) {
+                    failConnection(connection, ec);
+                    return;
+                }
+                connection->timeline.end(Phase::SftpInit);
+                disarmDeadline(*connection);
+                connection->handler(boost::system::error_code());
+            });
+        }
+
+        // Apply the method preferences and compression of options to a session before its handshake.
+        inline int configureSession(LIBSSH2_SESSION* session, const SessionOptions& options) {
+            if (options.compress) {
+                libssh2_session_flag(session, LIBSSH2_FLAG_COMPRESS, 1);
+            }
+            const std::pair<int, const std::string*> preferences[] = {
+                {LIBSSH2_METHOD_KEX, &options.kex_methods},
+                {LIBSSH2_METHOD_CRYPT_CS, &options.cipher_methods},
+                {LIBSSH2_METHOD_CRYPT_SC, &options.cipher_methods},
+                {LIBSSH2_METHOD_MAC_CS, &options.mac_methods},
+                {LIBSSH2_METHOD_MAC_SC, &options.mac_methods},
+            };
+            for (const auto& [method, preference] : preferences) {
+                if (preference->empty()) {
+                    continue;
+                }
+                // fails only if libssh2 supports none of the listed methods
+                int rc = libssh2_session_method_pref(session, method, preference->c_str());
+                if (rc) {
+                    return rc;
+                }
+            }
+            return 0;
+        }
+
+        inline int userauth(Connection& connection) {
+            const auto& options = connection.options;
+            if (!options.private_key_path.empty()) {
+                const char* public_key = options.public_key_path.empty() ? nullptr : options.public_key_path.c_str();
+                return libssh2_userauth_publickey_fromfile_ex(connection.session, connection.username.c_str(), connection.username.size(), public_key, options.private_key_path.c_str(), connection.password.c_str());
+            }
+            return libssh2_userauth_password(connection.session, connection.username.c_str(), connection.password.c_str());
+        }
+
+        inline void doAuthentication(std::shared_ptr<Connection> connection) {
+            connection->timeline.begin(Phase::Authenticate);
+            asyncRetry(connection, connection->wait_stats, [connection]() {
+                return userauth(*connection);
+            }, [connection](const boost::system::error_code& ec) {
+                if (ec) {
+                    failConnection(connection, ec);
+                    return;
+                }
+                connection->timeline.end(Phase::Authenticate);
+                doSFTPInit(connection);
+            });
+        }
+
+        // Pass the SHA-1 of the server's host key to options.host_key_handler once the handshake is done.
+        inline void reportHostKey(const Connection& connection) {
+            const char* fingerprint = libssh2_hostkey_hash(connection.session, LIBSSH2_HOSTKEY_HASH_SHA1);
+            if (fingerprint && connection.options.host_key_handler) {
+                connection.options.host_key_handler(std::string(fingerprint, 20));
+            }
+        }
+
+        inline void doSessionHandshake(std::shared_ptr<Connection> connection) {
+            connection->timeline.begin(Phase::Handshake);
+            asyncRetry(connection, connection->wait_stats, [connection]() {
+                return libssh2_session_handshake(connection->session, connection->socket->lowest_layer().native_handle());
+            }, [connection](const boost::system::error_code& ec) {
+                if (ec) {
+                    failConnection(connection, ec);
+                    return;
+                }
+                connection->timeline.end(Phase::Handshake);
+                reportHostKey(*connection);
+                doAuthentication(connection);
+            });
+        }
+
+        inline void connectHandler(const boost::system::error_code& ec, const tcp::endpoint& endpoint, std::shared_ptr<Connection> connection) {
+            if (ec || connection->abort_error) {
+                failConnection(connection, ec);
+                return;
+            }
+            connection->timeline.end(Phase::Connect);
+
+            // init libssh
+            connection->session = libssh2_session_init();
+            if (!connection->session) {
+                failConnection(connection, boost::system::error_code(LIBSSH2_ERROR_ALLOC, libssh2Category()));
+                return;
+            }
+
+            libssh2_session_set_blocking(connection->session, 0);
+
+            int rc = configureSession(connection->session, connection->options);
+            if (rc) {
+                failConnection(connection, boost::system::error_code(rc, libssh2Category()));
+                return;
+            }
+
+            doSessionHandshake(connection);
+
+        }
+
+        inline void resolveHandler(const boost::system::error_code& ec, const tcp::resolver::results_type& endpoints, std::shared_ptr<Connection> connection) {
+            if (ec || connection->abort_error) {
+                failConnection(connection, ec);
+                return;
+            }
+            if (endpoints.empty()) {
+                failConnection(connection, boost::asio::error::host_not_found);
+                return;
+            }
+            connection->timeline.end(Phase::Resolve);
+            connection->timeline.begin(Phase::Connect);
+
+            boost::asio::async_connect(*connection->socket, endpoints, [connection](const boost::system::error_code& ec, const tcp::endpoint& endpoint){
+                connectHandler(ec, endpoint, connection);
+            });
+        }
+
+        inline std::shared_ptr<Connection> makeConnection(boost::asio::io_context& ioc, const std::string& target_host, const std::string& username, const std::string& password, const SessionOptions& options = SessionOptions()) {
+            auto connection = std::make_shared<Connection>();
+            connection->target_host = target_host;
+            connection->username = username;
+            connection->password = password;
+            connection->options = options;
+            connection->resolver = std::make_unique<tcp::resolver>(ioc);
+            connection->socket = std::make_unique<tcp::socket>(ioc);
+            connection->driver = std::make_unique<SessionDriver>(SessionProtocol{&connection->session}, *connection->socket);
+            connection->deadline = std::make_unique<boost::asio::steady_timer>(ioc);
+            return connection;
+        }
+
+        // Resolve, connect, handshake, authenticate and start SFTP within options.connect_timeout, then call connection->handler.
+        inline void connect(std::shared_ptr<Connection> connection) {
+            armDeadline(connection, connection->options.connect_timeout);
+            connection->timeline.begin(Phase::Resolve);
+            connection->resolver->async_resolve(tcp::resolver::query(connection->target_host, connection->options.port), [connection](const boost::system::error_code& ec, const tcp::resolver::results_type& endpoints) {
+                resolveHandler(ec, endpoints, connection);
+            });
+        }
+
+        // Download [offset, end) of target_path over a connected session, handler is called once the remote handle is closed.
+        // options must have passed validateOptions. Without record_stats the transfer is left out of TransferStats.
+        template <class Handler>
+        void startDownload(std::shared_ptr<Connection> connection, const std::string& target_path, std::shared_ptr<Sink> sink, const DownloadOptions& options, std::uint64_t offset, std::uint64_t end, Handler&& handler, bool record_stats = true) {
+            auto context = std::make_shared<Context>();
+            context->record_stats = record_stats;
+            context->timeline.setRecording(record_stats);
+
+            context->buffer_pool = &boost::asio::use_service<BufferPool>(boost::asio::query(connection->socket->get_executor(), boost::asio::execution::context));
+            context->connection = std::move(connection);
+            context->target_path = target_path;
+            context->sink = std::move(sink);
+            context->options = options;
+            context->write_offset = offset;
+            context->read_end = end;
+            context->handler = std::forward<Handler>(handler);
+
+            armDeadline(context->connection, options.timeout, options.stall_timeout);
+            connectCancellation(context);
+            doOpenFile(context);
+        }
+
+        template <class Handler>
+        void startDownload(std::shared_ptr<Connection> connection, const std::string& target_path, std::shared_ptr<Sink> sink, const DownloadOptions& options, Handler&& handler) {
+            startDownload(std::move(connection), target_path, std::move(sink), options, 0, std::numeric_limits<std::uint64_t>::max(), std::forward<Handler>(handler));
+        }
+
+        using StatHandler = std::function<void(const boost::system::error_code&, const LIBSSH2_SFTP_ATTRIBUTES&)>;
+
+        inline void doStat(std::shared_ptr<Connection> connection, std::string path, StatHandler handler) {
+            auto attributes = std::make_shared<LIBSSH2_SFTP_ATTRIBUTES>();
+            armDeadline(connection, connection->options.request_timeout);
+            asyncRetry(connection, connection->wait_stats, [connection, path = std::move(path), attributes]() {
+                return libssh2_sftp_stat_ex(connection->sftp_session, path.c_str(), path.size(), LIBSSH2_SFTP_STAT, attributes.get());
+            }, [connection, attributes, handler = std::move(handler)](const boost::system::error_code& ec) {
+                disarmDeadline(*connection);
+                handler(ec, *attributes);
+            });
+        }
+
+        // Compares downloaded bytes with what a local file already holds at the same offsets.
+        class CompareSink : public Sink {
+        public:
+            CompareSink(boost::asio::io_context& ioc, const std::string& path, boost::system::error_code& ec) :
+                m_ioc(ioc)
+            {
+                m_fd = ::open(path.c_str(), O_RDONLY);
+                if (m_fd < 0) {
+                    ec.assign(errno, boost::system::system_category());
+                }
+            }
+
+            ~CompareSink()
+            {
+                if (m_fd >= 0) {
+                    ::close(m_fd);
+                }
+            }
+
+            // Reads and compares on the FileIoService pool like FileSink writes, the overlap can be as large as a read buffer.
+            void asyncWrite(std::uint64_t offset, PooledBuffer buffer, std::size_t size, Handler handler) override
+            {
+                auto work = boost::asio::prefer(m_ioc.get_executor(), boost::asio::execution::outstanding_work.tracked);
+                boost::asio::post(boost::asio::use_service<FileIoService>(m_ioc).pool(), [this, fd = m_fd, offset, size, buffer = std::move(buffer), handler = std::move(handler), work]() mutable {
+                    bool matches = true;
+                    char local[COMPARE_BLOCK_SIZE];
+                    for (std::size_t done = 0; matches && done < size;) {
+                        std::size_t length = std::min<std::size_t>(sizeof(local), size - done);
+                        ssize_t rc = ::pread(fd, local, length, offset + done);
+                        if (rc < 0 && errno == EINTR) {
+                            continue;
+                        }
+                        matches = rc > 0 && std::memcmp(local, buffer.data() + done, rc) == 0;
+                        done += rc > 0 ? rc : 0;
+                    }
+                    buffer.reset();
+                    // the download keeps the sink alive until every write has completed
+                    boost::asio::post(work, [this, matches, handler = std::move(handler)]() {
+                        if (!matches) {
+                            m_matches = false;
+                        }
+                        handler(boost::system::error_code());
+                    });
+                });
+            }
+
+            void asyncClose(std::uint64_t size, Handler handler) override
+            {
+                boost::asio::post(m_ioc, [handler = std::move(handler)]() {
+                    handler(boost::system::error_code());
+                });
+            }
+
+            bool matches() const
+            {
+                return m_matches;
+            }
+
+        private:
+            boost::asio::io_context& m_ioc;
+            int m_fd;
+            bool m_matches = true;
+        };
+
+        inline std::uint64_t localFileSize(const std::string& path) {
+            struct stat st;
+            return ::stat(path.c_str(), &st) == 0 ? static_cast<std::uint64_t>(st.st_size) : 0;
+        }
+
+        // Hashes the file on the FileIoService pool, then calls handler on the io_context.
+        inline void verifyChecksum(boost::asio::io_context& ioc, const std::string& path, const std::string& expected, std::function<void(const boost::system::error_code&)> handler) {
+            auto work = boost::asio::prefer(ioc.get_executor(), boost::asio::execution::outstanding_work.tracked);
+            boost::asio::post(boost::asio::use_service<FileIoService>(ioc).pool(), [path, expected, handler = std::move(handler), work]() mutable {
+                std::string actual = sha256File(path);
+                boost::asio::post(work, [matches = actual == expected, handler = std::move(handler)]() {
+                    handler(matches ? boost::system::error_code() : makeErrorCode(Error::ChecksumMismatch));
+                });
+            });
+        }
+
+        // Download target_path to destination_path. With options.resume the existing part of the destination is kept,
+        // after checking that its tail still matches the remote file.
+        inline void startFileDownload(boost::asio::io_context& ioc, std::shared_ptr<Connection> connection, const std::string& target_path, const std::string& destination_path, const DownloadOptions& options, std::function<void(const boost::system::error_code&)> handler) {
+            std::function<void(const boost::system::error_code&)> finish = [&ioc, destination_path, options, handler = std::move(handler)](const boost::system::error_code& ec) {
+                if (ec || options.expected_sha256.empty()) {
+                    handler(ec);
+                    return;
+                }
+                verifyChecksum(ioc, destination_path, options.expected_sha256, handler);
+            };
+            auto open = [&ioc, connection, target_path, destination_path, options, finish](std::uint64_t offset, bool truncate) {
+                boost::system::error_code ec;
+                auto sink = std::make_shared<FileSink>(ioc, destination_path, options.direct_io, truncate, ec);
+                if (ec) {
+                    boost::asio::post(ioc, [finish, ec]() {
+                        finish(ec);
+                    });
+                    return;
+                }
+                startDownload(connection, target_path, std::move(sink), options, offset, std::numeric_limits<std::uint64_t>::max(), finish);
+            };
+            auto restart = [open]() {
+                open(0, true);
+            };
+
+            std::uint64_t local_size = options.resume ? localFileSize(destination_path) : 0;
+            // O_DIRECT writes need aligned offsets, so resume from a block boundary
+            std::uint64_t resume_offset = local_size / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+            if (resume_offset == 0) {
+                restart();
+                return;
+            }
+
+            doStat(connection, target_path, [&ioc, connection, target_path, destination_path, options, finish, open, restart, local_size, resume_offset](const boost::system::error_code& ec, const LIBSSH2_SFTP_ATTRIBUTES& attributes) {
+                if (ec) {
+                    finish(ec);
+                    return;
+                }
+                if (!(attributes.flags & LIBSSH2_SFTP_ATTR_SIZE) || attributes.filesize < local_size) {
+                    // the remote file shrank or was replaced
+                    restart();
+                    return;
+                }
+                std::uint64_t overlap_begin = resume_offset - std::min<std::uint64_t>(options.resume_overlap, resume_offset);
+                boost::system::error_code open_ec;
+                auto compare = std::make_shared<CompareSink>(ioc, destination_path, open_ec);
+                if (open_ec) {
+                    finish(open_ec);
+                    return;
+                }
+                startDownload(connection, target_path, compare, options, overlap_begin, resume_offset, [finish, open, restart, resume_offset, compare](const boost::system::error_code& ec) {
+                    if (ec) {
+                        finish(ec);
+                    }
+                    else if (!compare->matches()) {
+                        restart();
+                    }
+                    else {
+                        open(resume_offset, false);
+                    }
+                }, false);
+            });
+        }
+
+        struct DirectoryEntry {
+            std::string name;
+            LIBSSH2_SFTP_ATTRIBUTES attributes;
+        };
+
+        using ListHandler = std::function<void(const boost::system::error_code&, std::vector<DirectoryEntry>)>;
+
+        struct ListContext {
+            std::shared_ptr<Connection> connection;
+            LIBSSH2_SFTP_HANDLE* sftp_handle = nullptr;
+            std::vector<DirectoryEntry> entries;
+            WaitStats wait_stats;
+            boost::system::error_code error;
+            ListHandler handler;
+        };
+
+        inline void finishListing(std::shared_ptr<ListContext> context) {
+            disarmDeadline(*context->connection);
+            context->sftp_handle = nullptr;
+            TransferStats::global().recordWaits(context->wait_stats.wakeups, context->wait_stats.spurious_wakeups);
+            context->handler(context->error, std::move(context->entries));
+        }
+
+        inline void doCloseDirectory(std::shared_ptr<ListContext> context) {
+            if (context->connection->failed) {
+                finishListing(context);
+                return;
+            }
+            asyncRetry(context->connection, context->wait_stats, [context]() {
+                return libssh2_sftp_closedir(context->sftp_handle);
+            }, [context](const boost::system::error_code& ec) {
+                if (ec && !context->error) {
+                    context->error = ec;
+                }
+                finishListing(context);
+            });
+        }
+
+        inline void doReadDirectory(std::shared_ptr<ListContext> context) {
+            // libssh2 fetches names in batches, so most calls return without a round trip
+            for (;;) {
+                char name[DIRECTORY_NAME_SIZE];
+                LIBSSH2_SFTP_ATTRIBUTES attributes;
+                int rc = libssh2_sftp_readdir_ex(context->sftp_handle, name, sizeof(name), nullptr, 0, &attributes);
+                if (rc > 0) {
+                    context->connection->last_progress = std::chrono::steady_clock::now();
+                    std::string entry(name, rc);
+                    if (entry != "." && entry != "..") {
+                        context->entries.push_back(DirectoryEntry{std::move(entry), attributes});
+                    }
+                }
+                else if (rc == 0) {
+                    doCloseDirectory(context);
+                    return;
+                }
+                else if (rc == LIBSSH2_ERROR_EAGAIN) {
+                    waitSession(*context->connection, context->wait_stats, [context](const boost::system::error_code& ec) {
+                        if (ec) {
+                            context->connection->failed = true;
+                            context->error = ec;
+                            finishListing(context);
+                            return;
+                        }
+                        doReadDirectory(context);
+                    });
+                    return;
+                }
+                else {
+                    context->error = sessionError(*context->connection, rc);
+                    doCloseDirectory(context);
+                    return;
+                }
+            }
+        }
+
+        // List a remote directory without "." and "..", the attributes come with the names so no stat is needed.
+        inline void listDirectory(std::shared_ptr<Connection> connection, const std::string& path, ListHandler handler) {
+            auto context = std::make_shared<ListContext>();
+            context->connection = std::move(connection);
+            context->handler = std::move(handler);
+            // large directories take many batches, so the request timeout bounds the gap between them
+            armDeadline(context->connection, std::chrono::milliseconds(0), context->connection->options.request_timeout);
+            asyncRetry(context->connection, context->wait_stats, [context, path]() {
+                auto& connection = *context->connection;
+                context->sftp_handle = libssh2_sftp_opendir(connection.sftp_session, path.c_str());
+                return context->sftp_handle ? 0 : libssh2_session_last_errno(connection.session);
+            }, [context](const boost::system::error_code& ec) {
+                if (ec) {
+                    context->error = ec;
+                    finishListing(context);
+                    return;
+                }
+                doReadDirectory(context);
+            });
+        }
+
+        struct UploadContext {
+            std::shared_ptr<Connection> connection;
+            LIBSSH2_SFTP_HANDLE* sftp_handle = nullptr;
+            std::string remote_path;
+            std::unique_ptr<MappedFile> source;
+            UploadOptions options;
+            // bytes the server has acknowledged, libssh2 keeps track of what it sent beyond that
+            std::uint64_t acked = 0;
+            bool send_woken = false;
+            // waits made while opening, writing and closing the remote file
+            WaitStats wait_stats;
+            PhaseTimeline timeline;
+            // first error of the upload, the handler gets it once the remote handle is closed
+            boost::system::error_code error;
+            // id in options.cancellation while the upload runs
+            std::uint64_t cancellation_slot = 0;
+
+            std::function<void(const boost::system::error_code&)> handler;
+        };
+
+        inline void finishUpload(std::shared_ptr<UploadContext> context) {
+            disconnectCancellation(*context);
+            disarmDeadline(*context->connection);
+            context->sftp_handle = nullptr;
+            context->timeline.end(Phase::Close);
+            auto& stats = TransferStats::global();
+            stats.recordWaits(context->wait_stats.wakeups, context->wait_stats.spurious_wakeups);
+            if (!context->error) {
+                stats.recordUpload(context->acked, context->timeline.duration(Phase::Transfer));
+            }
+            context->handler(context->error);
+        }
+
+        inline void doCloseUpload(std::shared_ptr<UploadContext> context) {
+            context->timeline.begin(Phase::Close);
+            if (!context->sftp_handle || context->connection->failed) {
+                finishUpload(context);
+                return;
+            }
+            asyncRetry(context->connection, context->wait_stats, [context]() {
+                return libssh2_sftp_close(context->sftp_handle);
+            }, [context](const boost::system::error_code& ec) {
+                // the server reports write errors it deferred when the handle is closed
+                if (ec && !context->error) {
+                    context->error = ec;
+                }
+                finishUpload(context);
+            });
+        }
+
+        inline void doSendFile(std::shared_ptr<UploadContext> context) {
+            const MappedFile& source = *context->source;
+            std::size_t window = context->options.write_window * context->options.write_chunk_size;
+            for (;;) {
+                std::uint64_t remaining = source.size() - context->acked;
+                if (remaining == 0) {
+                    context->timeline.end(Phase::Transfer);
+                    doCloseUpload(context);
+                    return;
+                }
+                // libssh2_sftp_write() splits the buffer into write requests and returns once the first ones are
+                // acknowledged, passing the same unacknowledged data again keeps the rest of the window in flight
+                std::size_t size = std::min<std::uint64_t>(window, remaining);
+                ssize_t rc = libssh2_sftp_write(context->sftp_handle, source.data() + context->acked, size);
+                if (rc > 0) {
+                    context->send_woken = false;
+                    context->connection->last_progress = std::chrono::steady_clock::now();
+                    context->acked += rc;
+                }
+                else if (rc == LIBSSH2_ERROR_EAGAIN) {
+                    if (context->send_woken) {
+                        ++context->wait_stats.spurious_wakeups;
+                    }
+                    waitSession(*context->connection, context->wait_stats, [context](const boost::system::error_code& ec) {
+                        if (ec) {
+                            context->connection->failed = true;
+                            context->error = ec;
+                            doCloseUpload(context);
+                            return;
+                        }
+                        context->send_woken = true;
+                        doSendFile(context);
+                    });
+                    return;
+                }
+                else {
+                    context->error = sessionError(*context->connection, static_cast<int>(rc));
+                    doCloseUpload(context);
+                    return;
+                }
+            }
+        }
+
+        inline void doOpenRemoteFile(std::shared_ptr<UploadContext> context) {
+            context->timeline.begin(Phase::Open);
+            asyncRetry(context->connection, context->wait_stats, [context]() {
+                auto& connection = *context->connection;
+                context->sftp_handle = libssh2_sftp_open(connection.sftp_session, context->remote_path.c_str(), LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC, context->options.mode);
+                return context->sftp_handle ? 0 : libssh2_session_last_errno(connection.session);
+            }, [context](const boost::system::error_code& ec) {
+                if (ec) {
+                    context->error = ec;
+                    doCloseUpload(context);
+                    return;
+                }
+                context->timeline.end(Phase::Open);
+                context->timeline.begin(Phase::Transfer);
+                doSendFile(context);
+            });
+        }
+
+        // Upload local_path over a connected session, handler is called once the remote handle is closed.
+        // options must have passed validateOptions.
+        template <class Handler>
+        void startUpload(std::shared_ptr<Connection> connection, const std::string& local_path, const std::string& remote_path, const UploadOptions& options, Handler&& handler) {
+            auto context = std::make_shared<UploadContext>();
+
+            context->connection = std::move(connection);
+            context->remote_path = remote_path;
+            context->source = std::make_unique<MappedFile>(local_path, context->error);
+            context->options = options;
+            context->handler = std::forward<Handler>(handler);
+
+            if (context->error) {
+                // complete outside the caller, which may be the connection handler the completion replaces
+                boost::asio::post(context->connection->socket->get_executor(), [context]() {
+                    doCloseUpload(context);
+                });
+                return;
+            }
+            armDeadline(context->connection, options.timeout, options.stall_timeout);
+            connectCancellation(context);
+            doOpenRemoteFile(context);
+        }
+
+    }
+
+    // Keeps authenticated sessions keyed by host and user warm between transfers.
+    // Like the rest of the library it must only be used from the io_context thread.
+    class SessionPool {
+    public:
+        SessionPool(boost::asio::io_context& ioc, const SessionOptions& options = SessionOptions()) :
+            m_ioc(ioc),
+            m_options(options)
+        {
+        }
+
+        // Calls handler(ec, connection) with an idle session for host and user, connecting a new one if there is none.
+        // If connecting fails the connection is null and the failed session has already been freed.
+        template <class Handler>
+        void acquire(const std::string& target_host, const std::string& username, const std::string& password, Handler&& handler)
+        {
+            auto& idle = m_idle[{target_host, username}];
+            if (!idle.empty()) {
+                auto connection = std::move(idle.back());
+                idle.pop_back();
+                boost::asio::post(m_ioc, [connection = std::move(connection), handler = std::forward<Handler>(handler)]() mutable {
+                    handler(boost::system::error_code(), std::move(connection));
+                });
+                return;
+            }
+            auto connection = impl::makeConnection(m_ioc, target_host, username, password, m_options);
+            // the connection owns its handler, so the handler must not own the connection
+            connection->handler = [connection = std::weak_ptr<impl::Connection>(connection), handler = std::forward<Handler>(handler)](const boost::system::error_code& ec) mutable {
+                // moved out so whatever the first acquirer captured is not kept alive while the session sits in the pool
+                auto acquired = std::move(handler);
+                acquired(ec, ec ? nullptr : connection.lock());
+            };
+            impl::connect(connection);
+        }
+
+        // Return a session after a transfer so the next acquire can reuse it, failed sessions are dropped and freed.
+        void release(std::shared_ptr<impl::Connection> connection)
+        {
+            if (connection->failed) {
+                return;
+            }
+            m_idle[{connection->target_host, connection->username}].push_back(std::move(connection));
+        }
+
+        // Disconnect every idle session.
+        void clear()
+        {
+            for (auto& [key, idle] : m_idle) {
+                for (auto& connection : idle) {
+                    connection->handler = [](const boost::system::error_code&){};
+                    impl::doDisconnect(connection);
+                }
+            }
+            m_idle.clear();
+        }
+
+        boost::asio::io_context& get_io_context()
+        {
+            return m_ioc;
+        }
+
+    private:
+        boost::asio::io_context& m_ioc;
+        SessionOptions m_options;
+        std::map<std::pair<std::string, std::string>, std::vector<std::shared_ptr<impl::Connection>>> m_idle;
+    };
+
+    template <class Handler>
+    void downloadFile(boost::asio::io_context& ioc, const std::string& target_host, const std::string& target_path, std::shared_ptr<Sink> sink, const std::string& username, const std::string& password, const SessionOptions& session_options, const DownloadOptions& options, Handler&& handler) {
+        impl::validateOptions(options);
+        auto connection = impl::makeConnection(ioc, target_host, username, password, session_options);
+        // the session is this download's own, so cancelling also aborts connecting and disconnecting it
+        std::uint64_t slot = impl::connectCancellation(options.cancellation, connection);
+        connection->handler = [connection = std::weak_ptr<impl::Connection>(connection), target_path, sink = std::move(sink), options, slot, handler = std::forward<Handler>(handler)](const boost::system::error_code& ec) mutable {
+            if (ec) {
+                impl::disconnectCancellation(options.cancellation, slot);
+                handler(ec);
+                return;
+            }
+            auto shared = connection.lock();
+            impl::startDownload(shared, target_path, std::move(sink), options, [shared, cancellation = options.cancellation, slot, handler = std::move(handler)](const boost::system::error_code& ec) mutable {
+                shared->handler = [cancellation, slot, handler = std::move(handler), ec](const boost::system::error_code&) mutable {
+                    impl::disconnectCancellation(cancellation, slot);
+                    handler(ec);
+                };
+                impl::doDisconnect(shared);
+            });
+        };
+        impl::connect(connection);
+    }
+
+    template <class Handler>
+    void downloadFile(boost::asio::io_context& ioc, const std::string& target_host, const std::string& target_path, std::shared_ptr<Sink> sink, const std::string& username, const std::string& password, const DownloadOptions& options, Handler&& handler) {
+        downloadFile(ioc, target_host, target_path, std::move(sink), username, password, SessionOptions(), options, std::forward<Handler>(handler));
+    }
+
+    template <class Handler>
+    void downloadFile(SessionPool& pool, const std::string& target_host, const std::string& target_path, std::shared_ptr<Sink> sink, const std::string& username, const std::string& password, const DownloadOptions& options, Handler&& handler) {
+        impl::validateOptions(options);
+        pool.acquire(target_host, username, password, [&pool, target_path, sink = std::move(sink), options, handler = std::forward<Handler>(handler)](const boost::system::error_code& ec, std::shared_ptr<impl::Connection> connection) mutable {
+            if (ec) {
+                handler(ec);
+                return;
+            }
+            impl::startDownload(connection, target_path, std::move(sink), options, [&pool, connection, handler = std::move(handler)](const boost::system::error_code& ec) mutable {
+                pool.release(connection);
+                handler(ec);
+            });
+        });
+    }
+
+    template <class Handler>
+    void downloadFile(SessionPool& pool, const std::string& target_host, const std::string& target_path, const std::string& destination_path, const std::string& username, const std::string& password, const DownloadOptions& options, Handler&& handler) {
+        impl::validateOptions(options);
+        pool.acquire(target_host, username, password, [&pool, target_path, destination_path, options, handler = std::forward<Handler>(handler)](const boost::system::error_code& ec, std::shared_ptr<impl::Connection> connection) mutable {
+            if (ec) {
+                handler(ec);
+                return;
+            }
+            impl::startFileDownload(pool.get_io_context(), connection, target_path, destination_path, options, [&pool, connection, handler = std::move(handler)](const boost::system::error_code& ec) mutable {
+                pool.release(connection);
+                handler(ec);
+            });
+        });
+    }
+
+    // Progress of one range of a segmented download, [done, end) is still missing.
+    struct Segment {
+        std::uint64_t begin;
+        std::uint64_t end;
+        std::uint64_t done;
+    };
+
+    // Shared between downloadFileSegmented calls so that a failed download can be resumed.
+    struct SegmentedDownloadState {
+        std::uint64_t size = 0;
+        std::vector<Segment> segments;
+    };
+
+    namespace impl {
+
+        // Forwards writes of one segment and advances Segment::done as the writes complete.
+        class SegmentSink : public Sink {
+        public:
+            SegmentSink(std::shared_ptr<Sink> sink, std::shared_ptr<SegmentedDownloadState> state, std::size_t index) :
+                m_sink(std::move(sink)),
+                m_state(std::move(state)),
+                m_index(index)
+            {
+            }
+
+            void asyncWrite(std::uint64_t offset, PooledBuffer buffer, std::size_t size, Handler handler) override
+            {
+                m_sink->asyncWrite(offset, std::move(buffer), size, [this, offset, size, handler = std::move(handler)](const boost::system::error_code& ec) {
+                    if (!ec) {
+                        // writes may complete out of order, only a contiguous prefix counts as done
+                        auto& segment = m_state->segments[m_index];
+                        m_completed[offset] = offset + size;
+                        for (auto it = m_completed.find(segment.done); it != m_completed.end(); it = m_completed.find(segment.done)) {
+                            segment.done = it->second;
+                            m_completed.erase(it);
+                        }
+                    }
+                    handler(ec);
+                });
+            }
+
+            void asyncClose(std::uint64_t size, Handler handler) override
+            {
+                // the underlying sink is closed once every segment is done
+                handler(boost::system::error_code());
+            }
+
+        private:
+            std::shared_ptr<Sink> m_sink;
+            std::shared_ptr<SegmentedDownloadState> m_state;
+            std::size_t m_index;
+            std::map<std::uint64_t, std::uint64_t> m_completed;
+        };
+
+        template <class Handler>
+        void startSegments(SessionPool& pool, const std::string& target_host, const std::string& target_path, std::shared_ptr<Sink> sink, const std::string& username, const std::string& password, const DownloadOptions& options, std::shared_ptr<SegmentedDownloadState> state, Handler&& handler) {
+            std::vector<std::size_t> missing;
+            for (std::size_t i = 0; i < state->segments.size(); ++i) {
+                if (state->segments[i].done < state->segments[i].end) {
+                    missing.push_back(i);
+                }
+            }
+
+            // the first failed segment is reported once every segment has stopped, state keeps what the others got
+            auto finish = [sink, state, handler = std::forward<Handler>(handler)](const boost::system::error_code& segment_ec) {
+                sink->asyncClose(state->size, [handler, segment_ec](const boost::system::error_code& ec) {
+                    handler(segment_ec ? segment_ec : ec);
+                });
+            };
+            if (missing.empty()) {
+                finish(boost::system::error_code());
+                return;
+            }
+
+            auto remaining = std::make_shared<std::size_t>(missing.size());
+            auto error = std::make_shared<boost::system::error_code>();
+            auto segment_done = [remaining, error, finish](const boost::system::error_code& ec) {
+                if (ec && !*error) {
+                    *error = ec;
+                }
+                if (--*remaining == 0) {
+                    finish(*error);
+                }
+            };
+            for (std::size_t index : missing) {
+                auto segment_sink = std::make_shared<SegmentSink>(sink, state, index);
+                pool.acquire(target_host, username, password, [&pool, target_path, segment_sink, options, state, index, segment_done](const boost::system::error_code& ec, std::shared_ptr<Connection> connection) {
+                    if (ec) {
+                        segment_done(ec);
+                        return;
+                    }
+                    const Segment& segment = state->segments[index];
+                    startDownload(connection, target_path, segment_sink, options, segment.done, segment.end, [&pool, connection, segment_sink, segment_done](const boost::system::error_code& ec) {
+                        pool.release(connection);
+                        segment_done(ec);
+                    });
+                });
+            }
+        }
+
+    }
+
+    // Fetch target_path as options.segments ranges over separate pooled sessions, each range written at its offset.
+    // Progress is kept in state; after a failure, calling again with the same state only fetches the missing ranges.
+    // All sessions come from pool and so run on its one io_context: segments overlap network round trips but share
+    // one thread for decryption. They are not spread over IoContextPool shards, run separate downloads through a
+    // ShardedDownloadScheduler to use more cores.
+    template <class Handler>
+    void downloadFileSegmented(SessionPool& pool, const std::string& target_host, const std::string& target_path, const std::string& destination_path, const std::string& username, const std::string& password, const DownloadOptions& options, std::shared_ptr<SegmentedDownloadState> state, Handler&& handler) {
+        if (options.segments == 0) {
+            throw std::invalid_argument("Segment count must be non-zero");
+        }
+        // a zero read buffer would leave nothing to size the segments by
+        impl::validateOptions(options);
+
+        if (!state->segments.empty()) {
+            boost::system::error_code ec;
+            auto sink = std::make_shared<FileSink>(pool.get_io_context(), destination_path, options.direct_io, false, ec);
+            if (ec) {
+                boost::asio::post(pool.get_io_context(), [handler = std::forward<Handler>(handler), ec]() mutable {
+                    handler(ec);
+                });
+                return;
+            }
+            impl::startSegments(pool, target_host, target_path, std::move(sink), username, password, options, std::move(state), std::forward<Handler>(handler));
+            return;
+        }
+
+        pool.acquire(target_host, username, password, [&pool, target_host, target_path, destination_path, username, password, options, state = std::move(state), handler = std::forward<Handler>(handler)](const boost::system::error_code& ec, std::shared_ptr<impl::Connection> connection) mutable {
+            if (ec) {
+                handler(ec);
+                return;
+            }
+            impl::doStat(connection, target_path, [&pool, connection, target_host, target_path, destination_path, username, password, options, state = std::move(state), handler = std::move(handler)](const boost::system::error_code& ec, const LIBSSH2_SFTP_ATTRIBUTES& attributes) mutable {
+                pool.release(connection);
+                if (ec) {
+                    handler(ec);
+                    return;
+                }
+                if (!(attributes.flags & LIBSSH2_SFTP_ATTR_SIZE)) {
+                    handler(makeErrorCode(Error::UnknownFileSize));
+                    return;
+                }
+
+                // segments are whole read buffers so every write but the last one is full and block aligned,
+                // the pool pads buffers to BUFFER_ALIGNMENT and they are filled to their padded size
+                std::uint64_t buffer_size = (options.read_window * options.read_chunk_size + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+                std::uint64_t buffers = (attributes.filesize + buffer_size - 1) / buffer_size;
+                std::uint64_t segment_size = (buffers + options.segments - 1) / options.segments * buffer_size;
+                state->size = attributes.filesize;
+                for (std::uint64_t begin = 0; begin < attributes.filesize; begin += segment_size) {
+                    std::uint64_t end = std::min<std::uint64_t>(begin + segment_size, attributes.filesize);
+                    state->segments.push_back(Segment{begin, end, begin});
+                }
+
+                boost::system::error_code open_ec;
+                auto sink = std::make_shared<FileSink>(pool.get_io_context(), destination_path, options.direct_io, true, open_ec);
+                if (open_ec) {
+                    handler(open_ec);
+                    return;
+                }
+                impl::startSegments(pool, target_host, target_path, std::move(sink), username, password, options, std::move(state), std::move(handler));
+            });
+        });
+    }
+
+    struct DownloadJob {
+        std::string target_host;
+        std::string target_path;
+        std::string destination_path;
+        std::string username;
+        std::string password;
+        DownloadOptions options;
+        std::function<void(const boost::system::error_code&)> handler;
+    };
+
+    // Runs queued downloads over pooled sessions, at most max_sessions_per_host at a time for each host.
+    class DownloadScheduler {
+    public:
+        DownloadScheduler(SessionPool& pool, std::size_t max_sessions_per_host) :
+            m_pool(pool),
+            m_max_sessions_per_host(max_sessions_per_host)
+        {
+            if (max_sessions_per_host == 0) {
+                throw std::invalid_argument("max_sessions_per_host must be non-zero");
+            }
+        }
+
+        // Throws for invalid job.options, a job that fails later only fails its own handler.
+        void enqueue(DownloadJob job)
+        {
+            impl::validateOptions(job.options);
+            auto& host = m_hosts[job.target_host];
+            host.queue.push_back(std::move(job));
+            pump(host);
+        }
+
+    private:
+        struct Host {
+            std::deque<DownloadJob> queue;
+            std::size_t active = 0;
+        };
+
+        void pump(Host& host)
+        {
+            while (host.active < m_max_sessions_per_host && !host.queue.empty()) {
+                DownloadJob job = std::move(host.queue.front());
+                host.queue.pop_front();
+                ++host.active;
+                // a failed job only fails its own handler, the queue keeps going
+                downloadFile(m_pool, job.target_host, job.target_path, job.destination_path, job.username, job.password, job.options, [this, &host, handler = std::move(job.handler)](const boost::system::error_code& ec) {
+                    --host.active;
+                    if (handler) {
+                        handler(ec);
+                    }
+                    pump(host);
+                });
+            }
+        }
+
+        SessionPool& m_pool;
+        std::size_t m_max_sessions_per_host;
+        // std::map nodes are stable, so pending handlers can refer to a Host
+        std::map<std::string, Host> m_hosts;
+    };
+
+    namespace impl {
+
+        // A directory tree walk feeding a DownloadScheduler, see mirrorDirectory.
+        class Mirror : public std::enable_shared_from_this<Mirror> {
+        public:
+            Mirror(SessionPool& pool, const std::string& target_host, const std::string& username, const std::string& password, const MirrorOptions& options, std::function<void(const boost::system::error_code&, const MirrorStats&)> handler) :
+                m_pool(pool),
+                m_scheduler(pool, options.download_sessions),
+                m_target_host(target_host),
+                m_username(username),
+                m_password(password),
+                m_options(options),
+                m_handler(std::move(handler))
+            {
+                if (options.listing_sessions == 0) {
+                    throw std::invalid_argument("listing_sessions must be non-zero");
+                }
+                // checked here, the scheduler only sees the options once files are found
+                validateOptions(options.download);
+            }
+
+            void start(const std::string& remote_path, const std::string& local_path)
+            {
+                if (makeLocalDirectory(local_path)) {
+                    m_directories.emplace_back(remote_path, local_path);
+                }
+                boost::asio::post(m_pool.get_io_context(), [self = shared_from_this()]() {
+                    self->pump();
+                });
+            }
+
+        private:
+            void fail(std::uint64_t& counter, const boost::system::error_code& ec)
+            {
+                ++counter;
+                if (!m_error) {
+                    m_error = ec;
+                }
+            }
+
+            bool makeLocalDirectory(const std::string& path)
+            {
+                if (::mkdir(path.c_str(), 0755) < 0 && errno != EEXIST) {
+                    fail(m_stats.directories_failed, boost::system::error_code(errno, boost::system::system_category()));
+                    return false;
+                }
+                return true;
+            }
+
+            // Unchanged if the local file has the remote size and modification time, which mirrored files get once downloaded.
+            static bool unchanged(const std::string& local_path, const LIBSSH2_SFTP_ATTRIBUTES& attributes)
+            {
+                struct stat st;
+                if (::stat(local_path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+                    return false;
+                }
+                return (attributes.flags & LIBSSH2_SFTP_ATTR_SIZE) && (attributes.flags & LIBSSH2_SFTP_ATTR_ACMODTIME) &&
+                    static_cast<std::uint64_t>(st.st_size) == attributes.filesize && static_cast<unsigned long>(st.st_mtime) == attributes.mtime;
+            }
+
+            void pump()
+            {
+                while (m_listing < m_options.listing_sessions && !m_directories.empty()) {
+                    auto [remote_path, local_path] = std::move(m_directories.front());
+                    m_directories.pop_front();
+                    ++m_listing;
+                    m_pool.acquire(m_target_host, m_username, m_password, [self = shared_from_this(), remote_path = remote_path, local_path = local_path](const boost::system::error_code& ec, std::shared_ptr<Connection> connection) {
+                        if (ec) {
+                            self->listed(ec, remote_path, local_path, {});
+                            return;
+                        }
+                        listDirectory(connection, remote_path, [self, connection, remote_path, local_path](const boost::system::error_code& ec, std::vector<DirectoryEntry> entries) {
+                            self->m_pool.release(connection);
+                            self->listed(ec, remote_path, local_path, entries);
+                        });
+                    });
+                }
+                if (m_listing == 0 && m_downloading == 0 && m_directories.empty() && m_handler) {
+                    auto handler = std::move(m_handler);
+                    m_handler = nullptr;
+                    handler(m_error, m_stats);
+                }
+            }
+
+            void listed(const boost::system::error_code& ec, const std::string& remote_path, const std::string& local_path, const std::vector<DirectoryEntry>& entries)
+            {
+                --m_listing;
+                if (ec) {
+                    fail(m_stats.directories_failed, ec);
+                    pump();
+                    return;
+                }
+                ++m_stats.directories;
+                for (const auto& entry : entries) {
+                    std::string remote_entry = remote_path + "/" + entry.name;
+                    std::string local_entry = local_path + "/" + entry.name;
+                    unsigned long type = entry.attributes.permissions & LIBSSH2_SFTP_S_IFMT;
+                    if (type == LIBSSH2_SFTP_S_IFDIR) {
+                        if (makeLocalDirectory(local_entry)) {
+                            m_directories.emplace_back(std::move(remote_entry), std::move(local_entry));
+                        }
+                    }
+                    else if (type == LIBSSH2_SFTP_S_IFREG) {
+                        if (unchanged(local_entry, entry.attributes)) {
+                            ++m_stats.files_skipped;
+                        }
+                        else {
+                            download(std::move(remote_entry), std::move(local_entry), entry.attributes);
+                        }
+                    }
+                    // symlinks and special files are not mirrored
+                }
+                pump();
+            }
+
+            void download(std::string remote_path, std::string local_path, const LIBSSH2_SFTP_ATTRIBUTES& attributes)
+            {
+                ++m_downloading;
+                DownloadJob job;
+                job.target_host = m_target_host;
+                job.target_path = std::move(remote_path);
+                job.destination_path = local_path;
+                job.username = m_username;
+                job.password = m_password;
+                job.options = m_options.download;
+                job.handler = [self = shared_from_this(), local_path, attributes](const boost::system::error_code& ec) {
+                    --self->m_downloading;
+                    if (ec) {
+                        self->fail(self->m_stats.files_failed, ec);
+                    }
+                    else {
+                        if (attributes.flags & LIBSSH2_SFTP_ATTR_ACMODTIME) {
+                            struct timespec times[2] = {{static_cast<time_t>(attributes.atime), 0}, {static_cast<time_t>(attributes.mtime), 0}};
+                            ::utimensat(AT_FDCWD, local_path.c_str(), times, 0);
+                        }
+                        ++self->m_stats.files_downloaded;
+                        self->m_stats.bytes_downloaded += attributes.filesize;
+                    }
+                    self->pump();
+                };
+                m_scheduler.enqueue(std::move(job));
+            }
+
+            SessionPool& m_pool;
+            DownloadScheduler m_scheduler;
+            std::string m_target_host;
+            std::string m_username;
+            std::string m_password;
+            MirrorOptions m_options;
+            std::function<void(const boost::system::error_code&, const MirrorStats&)> m_handler;
+            // remote and local path of directories waiting to be listed
+            std::deque<std::pair<std::string, std::string>> m_directories;
+            std::size_t m_listing = 0;
+            std::size_t m_downloading = 0;
+            MirrorStats m_stats;
+            boost::system::error_code m_error;
+        };
+
+    }
+
+    // Mirror the remote tree under target_path into destination_path. Directories are listed over
+    // options.listing_sessions sessions while the files found are downloaded over options.download_sessions,
+    // skipping files whose local size and modification time match. A failed directory or file does not stop the
+    // rest, handler(ec, stats) gets the first error and counts of everything that happened.
+    template <class Handler>
+    void mirrorDirectory(SessionPool& pool, const std::string& target_host, const std::string& target_path, const std::string& destination_path, const std::string& username, const std::string& password, const MirrorOptions& options, Handler&& handler) {
+        auto mirror = std::make_shared<impl::Mirror>(pool, target_host, username, password, options, std::forward<Handler>(handler));
+        mirror->start(target_path, destination_path);
+    }
+
+    // One io_context per thread. libssh2 sessions are not thread safe, so anything created on a shard stays on it.
+    class IoContextPool {
+    public:
+        explicit IoContextPool(std::size_t size = std::thread::hardware_concurrency())
+        {
+            for (std::size_t i = 0; i < std::max<std::size_t>(size, 1); ++i) {
+                m_contexts.push_back(std::make_unique<boost::asio::io_context>(1));
+            }
+        }
+
+        std::size_t size() const
+        {
+            return m_contexts.size();
+        }
+
+        boost::asio::io_context& get_io_context(std::size_t index)
+        {
+            return *m_contexts[index % m_contexts.size()];
+        }
+
+        // Runs every io_context on its own thread until all of them are out of work, like io_context::run.
+        // The first exception stops the other shards and is rethrown here.
+        void run()
+        {
+            std::exception_ptr error;
+            std::mutex error_mutex;
+            std::vector<std::thread> threads;
+            for (auto& ioc : m_contexts) {
+                threads.emplace_back([this, &ioc, &error, &error_mutex]() {
+                    try {
+                        ioc->run();
+                    }
+                    catch (...) {
+                        std::lock_guard<std::mutex> lock(error_mutex);
+                        if (!error) {
+                            error = std::current_exception();
+                        }
+                        stop();
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            for (auto& ioc : m_contexts) {
+                ioc->restart();
+            }
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        void stop()
+        {
+            for (auto& ioc : m_contexts) {
+                ioc->stop();
+            }
+        }
+
+    private:
+        std::vector<std::unique_ptr<boost::asio::io_context>> m_contexts;
+    };
+
+    // A SessionPool and DownloadScheduler per shard of an IoContextPool. Jobs are spread round robin over
+    // the shards, so the crypto of concurrent downloads runs on every core while each session only ever
+    // runs on the thread of its shard. max_sessions_per_host applies to each shard, and job handlers are
+    // called on the shard that ran the job.
+    class ShardedDownloadScheduler {
+    public:
+        ShardedDownloadScheduler(IoContextPool& contexts, std::size_t max_sessions_per_host, const SessionOptions& options = SessionOptions())
+        {
+            for (std::size_t i = 0; i < contexts.size(); ++i) {
+                m_shards.push_back(std::make_unique<Shard>(contexts.get_io_context(i), max_sessions_per_host, options));
+            }
+        }
+
+        // Safe to call from any thread, throws for invalid job.options before the job reaches a shard.
+        void enqueue(DownloadJob job)
+        {
+            impl::validateOptions(job.options);
+            Shard& shard = *m_shards[m_next.fetch_add(1, std::memory_order_relaxed) % m_shards.size()];
+            boost::asio::post(shard.pool.get_io_context(), [&shard, job = std::move(job)]() mutable {
+                shard.scheduler.enqueue(std::move(job));
+            });
+        }
+
+        // Disconnect every idle session of every shard.
+        void clear()
+        {
+            for (auto& shard : m_shards) {
+                boost::asio::post(shard->pool.get_io_context(), [&shard = *shard]() {
+                    shard.pool.clear();
+                });
+            }
+        }
+
+    private:
+        struct Shard {
+            Shard(boost::asio::io_context& ioc, std::size_t max_sessions_per_host, const SessionOptions& options) :
+                pool(ioc, options),
+                scheduler(pool, max_sessions_per_host)
+            {
+            }
+
+            SessionPool pool;
+            DownloadScheduler scheduler;
+        };
+
+        std::vector<std::unique_ptr<Shard>> m_shards;
+        std::atomic<std::size_t> m_next{0};
+    };
+
+    template <class Handler>
+    void downloadFile(boost::asio::io_context& ioc, const std::string& target_host, const std::string& target_path, const std::string& destination_path, const std::string& username, const std::string& password, const SessionOptions& session_options, const DownloadOptions& options, Handler&& handler) {
+        impl::validateOptions(options);
+        auto connection = impl::makeConnection(ioc, target_host, username, password, session_options);
+        std::uint64_t slot = impl::connectCancellation(options.cancellation, connection);
+        connection->handler = [&ioc, connection = std::weak_ptr<impl::Connection>(connection), target_path, destination_path, options, slot, handler = std::forward<Handler>(handler)](const boost::system::error_code& ec) mutable {
+            if (ec) {
+                impl::disconnectCancellation(options.cancellation, slot);
+                handler(ec);
+                return;
+            }
+            auto shared = connection.lock();
+            impl::startFileDownload(ioc, shared, target_path, destination_path, options, [shared, cancellation = options.cancellation, slot, handler = std::move(handler)](const boost::system::error_code& ec) mutable {
+                shared->handler = [cancellation, slot, handler = std::move(handler), ec](const boost::system::error_code&) mutable {
+                    impl::disconnectCancellation(cancellation, slot);
+                    handler(ec);
+                };
+                impl::doDisconnect(shared);
+            });
+        };
+        impl::connect(connection);
+    }
+
+    template <class Handler>
+    void downloadFile(boost::asio::io_context& ioc, const std::string& target_host, const std::string& target_path, const std::string& destination_path, const std::string& username, const std::string& password, const DownloadOptions& options, Handler&& handler) {
+        downloadFile(ioc, target_host, target_path, destination_path, username, password, SessionOptions(), options, std::forward<Handler>(handler));
+    }
+
+    template <class Handler>
+    void downloadFile(boost::asio::io_context& ioc, const std::string& target_host, const std::string& target_path, const std::string& destination_path, const std::string& username, const std::string& password, Handler&& handler) {
+        downloadFile(ioc, target_host, target_path, destination_path, username, password, DownloadOptions(), std::forward<Handler>(handler));
+    }
+
+    template <class Handler>
+    void uploadFile(boost::asio::io_context& ioc, const std::string& target_host, const std::string& local_path, const std::string& remote_path, const std::string& username, const std::string& password, const SessionOptions& session_options, const UploadOptions& options, Handler&& handler) {
+        impl::validateOptions(options);
+        auto connection = impl::makeConnection(ioc, target_host, username, password, session_options);
+        std::uint64_t slot = impl::connectCancellation(options.cancellation, connection);
+        connection->handler = [connection = std::weak_ptr<impl::Connection>(connection), local_path, remote_path, options, slot, handler = std::forward<Handler>(handler)](const boost::system::error_code& ec) mutable {
+            if (ec) {
+                impl::disconnectCancellation(options.cancellation, slot);
+                handler(ec);
+                return;
+            }
+            auto shared = connection.lock();
+            impl::startUpload(shared, local_path, remote_path, options, [shared, cancellation = options.cancellation, slot, handler = std::move(handler)](const boost::system::error_code& ec) mutable {
+                shared->handler = [cancellation, slot, handler = std::move(handler), ec](const boost::system::error_code&) mutable {
+                    impl::disconnectCancellation(cancellation, slot);
+                    handler(ec);
+                };
+                impl::doDisconnect(shared);
+            });
+        };
+        impl::connect(connection);
+    }
+
+    template <class Handler>
+    void uploadFile(boost::asio::io_context& ioc, const std::string& target_host, const std::string& local_path, const std::string& remote_path, const std::string& username, const std::string& password, const UploadOptions& options, Handler&& handler) {
+        uploadFile(ioc, target_host, local_path, remote_path, username, password, SessionOptions(), options, std::forward<Handler>(handler));
+    }
+
+    template <class Handler>
+    void uploadFile(boost::asio::io_context& ioc, const std::string& target_host, const std::string& local_path, const std::string& remote_path, const std::string& username, const std::string& password, Handler&& handler) {
+        uploadFile(ioc, target_host, local_path, remote_path, username, password, UploadOptions(), std::forward<Handler>(handler));
+    }
+
+    template <class Handler>
+    void uploadFile(SessionPool& pool, const std::string& target_host, const std::string& local_path, const std::string& remote_path, const std::string& username, const std::string& password, const UploadOptions& options, Handler&& handler) {
+        impl::validateOptions(options);
+        pool.acquire(target_host, username, password, [&pool, local_path, remote_path, options, handler = std::forward<Handler>(handler)](const boost::system::error_code& ec, std::shared_ptr<impl::Connection> connection) mutable {
+            if (ec) {
+                handler(ec);
+                return;
+            }
+            impl::startUpload(connection, local_path, remote_path, options, [&pool, connection, handler = std::move(handler)](const boost::system::error_code& ec) mutable {
+                pool.release(connection);
+                handler(ec);
+            });
+        });
+    }
+
+#ifdef BOOST_ASIO_HAS_CO_AWAIT
+    namespace impl {
+
+        // Coroutine form of asyncRetry.
+        template <class Operation>
+        boost::asio::awaitable<int> retry(Connection& connection, Operation operation)
+        {
+            bool woken = false;
+            for (;;) {
+                int rc = operation();
+                if (rc != LIBSSH2_ERROR_EAGAIN) {
+                    co_return rc;
+                }
+                if (woken) {
+                    ++connection.wait_stats.spurious_wakeups;
+                }
+                co_await boost::asio::async_initiate<decltype(boost::asio::use_awaitable), void(boost::system::error_code)>([&](auto handler) {
+                    waitSession(connection, connection.wait_stats, std::move(handler));
+                }, boost::asio::use_awaitable);
+                woken = true;
+            }
+        }
+
+    }
+
+    // An open remote file, see SshSession::open.
+    class SftpFile {
+    public:
+        SftpFile(std::shared_ptr<impl::Connection> connection, LIBSSH2_SFTP_HANDLE* handle) :
+            m_connection(std::move(connection)),
+            m_handle(handle)
+        {
+        }
+
+        // Read into buffer, returns 0 at end of file.
+        boost::asio::awaitable<std::size_t> read(boost::asio::mutable_buffer buffer)
+        {
+            ssize_t rc = 0;
+            co_await impl::retry(*m_connection, [&]() {
+                rc = libssh2_sftp_read(m_handle, static_cast<char*>(buffer.data()), buffer.size());
+                return rc < 0 ? static_cast<int>(rc) : 0;
+            });
+            if (rc < 0) {
+                throw boost::system::system_error(impl::sessionError(*m_connection, static_cast<int>(rc)), "Failed to receive file");
+            }
+            co_return static_cast<std::size_t>(rc);
+        }
+
+        boost::asio::awaitable<void> close()
+        {
+            int rc = co_await impl::retry(*m_connection, [&]() {
+                return libssh2_sftp_close(m_handle);
+            });
+            m_handle = nullptr;
+            if (rc) {
+                throw boost::system::system_error(impl::sessionError(*m_connection, rc), "Failed to close file");
+            }
+        }
+
+    private:
+        std::shared_ptr<impl::Connection> m_connection;
+        LIBSSH2_SFTP_HANDLE* m_handle;
+    };
+
+    // Awaitable steps of the same state machine the callback chain runs, e.g. co_await ssh.handshake().
+    // Failures are thrown as boost::system::system_error with the libssh2 or sftp category.
+    class SshSession {
+    public:
+        explicit SshSession(boost::asio::io_context& ioc, const SessionOptions& options = SessionOptions()) :
+            m_connection(std::make_shared<impl::Connection>())
+        {
+            m_connection->options = options;
+            m_connection->resolver = std::make_unique<tcp::resolver>(ioc);
+            m_connection->socket = std::make_unique<tcp::socket>(ioc);
+            m_connection->driver = std::make_unique<impl::SessionDriver>(impl::SessionProtocol{&m_connection->session}, *m_connection->socket);
+        }
+
+        boost::asio::awaitable<void> connect(const std::string& target_host)
+        {
+            m_connection->target_host = target_host;
+            m_connection->timeline.begin(Phase::Resolve);
+            auto endpoints = co_await m_connection->resolver->async_resolve(target_host, m_connection->options.port, boost::asio::use_awaitable);
+            m_connection->timeline.end(Phase::Resolve);
+            m_connection->timeline.begin(Phase::Connect);
+            co_await boost::asio::async_connect(*m_connection->socket, endpoints, boost::asio::use_awaitable);
+            m_connection->timeline.end(Phase::Connect);
+
+            m_connection->session = libssh2_session_init();
+            if (!m_connection->session) {
+                throw boost::system::system_error(boost::system::error_code(LIBSSH2_ERROR_ALLOC, libssh2Category()), "Init session failed");
+            }
+            libssh2_session_set_blocking(m_connection->session, 0);
+            int rc = impl::configureSession(m_connection->session, m_connection->options);
+            if (rc) {
+                throw boost::system::system_error(boost::system::error_code(rc, libssh2Category()), "Unsupported session methods");
+            }
+        }
+
+        boost::asio::awaitable<void> handshake()
+        {
+            m_connection->timeline.begin(Phase::Handshake);
+            int rc = co_await impl::retry(*m_connection, [this]() {
+                return libssh2_session_handshake(m_connection->session, m_connection->socket->native_handle());
+            });
+            if (rc) {
+                throw boost::system::system_error(impl::sessionError(*m_connection, rc), "Failed to create ssh session");
+            }
+            m_connection->timeline.end(Phase::Handshake);
+            impl::reportHostKey(*m_connection);
+        }
+
+        boost::asio::awaitable<void> authenticate(const std::string& username, const std::string& password)
+        {
+            m_connection->username = username;
+            m_connection->password = password;
+            m_connection->timeline.begin(Phase::Authenticate);
+            int rc = co_await impl::retry(*m_connection, [this]() {
+                return impl::userauth(*m_connection);
+            });
+            if (rc) {
+                throw boost::system::system_error(impl::sessionError(*m_connection, rc), "Failed to authenticate");
+            }
+            m_connection->timeline.end(Phase::Authenticate);
+        }
+
+        boost::asio::awaitable<void> sftpInit()
+        {
+            m_connection->timeline.begin(Phase::SftpInit);
+            int rc = co_await impl::retry(*m_connection, [this]() {
+                m_connection->sftp_session = libssh2_sftp_init(m_connection->session);
+                return m_connection->sftp_session ? 0 : libssh2_session_last_errno(m_connection->session);
+            });
+            if (rc) {
+                throw boost::system::system_error(impl::sessionError(*m_connection, rc), "Failed to init sftp session");
+            }
+            m_connection->timeline.end(Phase::SftpInit);
+        }
+
+        boost::asio::awaitable<SftpFile> open(const std::string& path)
+        {
+            LIBSSH2_SFTP_HANDLE* handle = nullptr;
+            int rc = co_await impl::retry(*m_connection, [&]() {
+                handle = libssh2_sftp_open(m_connection->sftp_session, path.c_str(), LIBSSH2_FXF_READ, 0);
+                return handle ? 0 : libssh2_session_last_errno(m_connection->session);
+            });
+            if (rc) {
+                throw boost::system::system_error(impl::sessionError(*m_connection, rc), "Failed to open file");
+            }
+            co_return SftpFile(m_connection, handle);
+        }
+
+        boost::asio::awaitable<void> disconnect()
+        {
+            m_connection->timeline.begin(Phase::Disconnect);
+            co_await impl::retry(*m_connection, [this]() {
+                return libssh2_sftp_shutdown(m_connection->sftp_session);
+            });
+            m_connection->sftp_session = nullptr;
+            co_await impl::retry(*m_connection, [this]() {
+                return libssh2_session_disconnect(m_connection->session, "Normal Shutdown");
+            });
+            // a non-blocking session may need to wait before it can be freed, on failure the destructor frees it
+            int rc = co_await impl::retry(*m_connection, [this]() {
+                return libssh2_session_free(m_connection->session);
+            });
+            if (rc == 0) {
+                m_connection->session = nullptr;
+            }
+            m_connection->timeline.end(Phase::Disconnect);
+            TransferStats::global().recordWaits(m_connection->wait_stats.wakeups, m_connection->wait_stats.spurious_wakeups);
+        }
+
+        // The underlying session, e.g. to hand it to a SessionPool.
+        std::shared_ptr<impl::Connection> connection() const
+        {
+            return m_connection;
+        }
+
+    private:
+        std::shared_ptr<impl::Connection> m_connection;
+    };
+
+    namespace impl {
+
+        // The coroutine takes everything by value, it runs after the caller's arguments are gone.
+        inline boost::asio::awaitable<void> downloadFileCoroutine(boost::asio::io_context& ioc, std::string target_host, std::string target_path, std::shared_ptr<Sink> sink, std::string username, std::string password, SessionOptions session_options, DownloadOptions options)
+        {
+            SshSession ssh(ioc, session_options);
+            co_await ssh.connect(target_host);
+            co_await ssh.handshake();
+            co_await ssh.authenticate(username, password);
+            co_await ssh.sftpInit();
+            SftpFile file = co_await ssh.open(target_path);
+
+            auto& pool = boost::asio::use_service<BufferPool>(ioc);
+            BufferPoolStats stats;
+            std::uint64_t offset = 0;
+            bool done = false;
+            while (!done) {
+                PooledBuffer buffer = pool.acquire(options.read_window * options.read_chunk_size, stats);
+                std::size_t filled = 0;
+                while (filled < buffer.size()) {
+                    std::size_t n = co_await file.read(boost::asio::buffer(buffer.data() + filled, buffer.size() - filled));
+                    if (n == 0) {
+                        done = true;
+                        break;
+                    }
+                    filled += n;
+                }
+                if (filled > 0) {
+                    co_await boost::asio::async_initiate<decltype(boost::asio::use_awaitable), void(boost::system::error_code)>([&](auto handler) {
+                        // Sink::Handler is a std::function, which needs a copyable target
+                        auto shared = std::make_shared<decltype(handler)>(std::move(handler));
+                        sink->asyncWrite(offset, std::move(buffer), filled, [shared](const boost::system::error_code& ec) {
+                            (*shared)(ec);
+                        });
+                    }, boost::asio::use_awaitable);
+                    offset += filled;
+                }
+            }
+
+            co_await boost::asio::async_initiate<decltype(boost::asio::use_awaitable), void(boost::system::error_code)>([&](auto handler) {
+                auto shared = std::make_shared<decltype(handler)>(std::move(handler));
+                sink->asyncClose(offset, [shared](const boost::system::error_code& ec) {
+                    (*shared)(ec);
+                });
+            }, boost::asio::use_awaitable);
+
+            co_await file.close();
+            co_await ssh.disconnect();
+        }
+
+    }
+
+    // Coroutine counterpart of downloadFile, each full buffer is written to the sink before the next read.
+    // Throws for invalid options here, like downloadFile, rather than once the coroutine runs.
+    inline boost::asio::awaitable<void> downloadFileAwaitable(boost::asio::io_context& ioc, const std::string& target_host, const std::string& target_path, std::shared_ptr<Sink> sink, const std::string& username, const std::string& password, const SessionOptions& session_options = SessionOptions(), const DownloadOptions& options = DownloadOptions())
+    {
+        impl::validateOptions(options);
+        return impl::downloadFileCoroutine(ioc, target_host, target_path, std::move(sink), username, password, session_options, options);
+    }
+#endif
+}
+
+#endif
@@ -0,0 +1,250 @@
+// TransferStats.hpp
+
+#pragma once
+#ifndef TransferStats_HEADER
+#define TransferStats_HEADER
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <sstream>
+#include <string>
+
+// log2 of the number of sub-buckets per power of two, 3 keeps the error of a bucket below 12.5%
+#define HISTOGRAM_SUB_BUCKET_BITS 3
+
+namespace Libssh2Wrapper {
+
+    enum class Phase {
+        Resolve,
+        Connect,
+        Handshake,
+        Authenticate,
+        SftpInit,
+        Open,
+        Transfer,
+        Close,
+        Disconnect,
+        Count
+    };
+
+    constexpr std::size_t PHASE_COUNT = static_cast<std::size_t>(Phase::Count);
+
+    inline const char* phaseName(Phase phase)
+    {
+        switch (phase) {
+            case Phase::Resolve: return "resolve";
+            case Phase::Connect: return "connect";
+            case Phase::Handshake: return "handshake";
+            case Phase::Authenticate: return "authenticate";
+            case Phase::SftpInit: return "sftp_init";
+            case Phase::Open: return "open";
+            case Phase::Transfer: return "transfer";
+            case Phase::Close: return "close";
+            case Phase::Disconnect: return "disconnect";
+            default: return "unknown";
+        }
+    }
+
+    // HDR-style histogram with log-linear buckets, recording is a few relaxed atomic increments.
+    class Histogram {
+    public:
+        static constexpr std::size_t SUB_BUCKETS = std::size_t(1) << HISTOGRAM_SUB_BUCKET_BITS;
+        static constexpr std::size_t BUCKETS = (64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+        void record(std::uint64_t value)
+        {
+            m_counts[index(value)].fetch_add(1, std::memory_order_relaxed);
+            m_count.fetch_add(1, std::memory_order_relaxed);
+            m_sum.fetch_add(value, std::memory_order_relaxed);
+            std::uint64_t max = m_max.load(std::memory_order_relaxed);
+            while (value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+            }
+        }
+
+        std::uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+        std::uint64_t sum() const { return m_sum.load(std::memory_order_relaxed); }
+        std::uint64_t max() const { return m_max.load(std::memory_order_relaxed); }
+
+        // Lower bound of the bucket holding the given quantile, 0 if nothing was recorded.
+        std::uint64_t percentile(double quantile) const
+        {
+            std::uint64_t total = count();
+            if (total == 0) {
+                return 0;
+            }
+            std::uint64_t target = static_cast<std::uint64_t>(quantile * (total - 1)) + 1;
+            std::uint64_t seen = 0;
+            for (std::size_t i = 0; i < BUCKETS; ++i) {
+                seen += m_counts[i].load(std::memory_order_relaxed);
+                if (seen >= target) {
+                    return lowerBound(i);
+                }
+            }
+            return max();
+        }
+
+    private:
+        static std::size_t index(std::uint64_t value)
+        {
+            if (value < SUB_BUCKETS) {
+                return static_cast<std::size_t>(value);
+            }
+            int msb = 63 - __builtin_clzll(value);
+            int shift = msb - HISTOGRAM_SUB_BUCKET_BITS;
+            return (shift + 1) * SUB_BUCKETS + static_cast<std::size_t>((value >> shift) - SUB_BUCKETS);
+        }
+
+        static std::uint64_t lowerBound(std::size_t index)
+        {
+            if (index < SUB_BUCKETS) {
+                return index;
+            }
+            std::size_t shift = index / SUB_BUCKETS - 1;
+            return static_cast<std::uint64_t>(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+        }
+
+        std::array<std::atomic<std::uint64_t>, BUCKETS> m_counts{};
+        std::atomic<std::uint64_t> m_count{0};
+        std::atomic<std::uint64_t> m_sum{0};
+        std::atomic<std::uint64_t> m_max{0};
+    };
+
+    // Process wide aggregate of every connection and transfer, see global().
+    class TransferStats {
+    public:
+        static TransferStats& global()
+        {
+            static TransferStats stats;
+            return stats;
+        }
+
+        void recordPhase(Phase phase, std::chrono::nanoseconds duration)
+        {
+            m_phases[static_cast<std::size_t>(phase)].record(static_cast<std::uint64_t>(duration.count()));
+        }
+
+        void recordWaits(std::uint64_t wakeups, std::uint64_t spurious_wakeups)
+        {
+            m_wakeups.fetch_add(wakeups, std::memory_order_relaxed);
+            m_spurious_wakeups.fetch_add(spurious_wakeups, std::memory_order_relaxed);
+        }
+
+        void recordDownload(std::uint64_t bytes, std::chrono::nanoseconds duration)
+        {
+            m_bytes_received.fetch_add(bytes, std::memory_order_relaxed);
+            recordThroughput(bytes, duration);
+        }
+
+        void recordUpload(std::uint64_t bytes, std::chrono::nanoseconds duration)
+        {
+            m_bytes_sent.fetch_add(bytes, std::memory_order_relaxed);
+            recordThroughput(bytes, duration);
+        }
+
+        const Histogram& phase(Phase phase) const
+        {
+            return m_phases[static_cast<std::size_t>(phase)];
+        }
+
+        std::string toText() const
+        {
+            std::ostringstream out;
+            out << "phase count mean_us p50_us p99_us max_us\n";
+            for (std::size_t i = 0; i < PHASE_COUNT; ++i) {
+                const Histogram& histogram = m_phases[i];
+                out << phaseName(static_cast<Phase>(i)) << " " << histogram.count() << " " << mean(histogram) / 1000.0 << " "
+                    << histogram.percentile(0.5) / 1000.0 << " " << histogram.percentile(0.99) / 1000.0 << " " << histogram.max() / 1000.0 << "\n";
+            }
+            out << "transfers " << m_throughput.count() << "\n";
+            out << "bytes_received " << m_bytes_received.load(std::memory_order_relaxed) << "\n";
+            out << "bytes_sent " << m_bytes_sent.load(std::memory_order_relaxed) << "\n";
+            out << "throughput_p50_bytes_per_second " << m_throughput.percentile(0.5) << "\n";
+            out << "wakeups " << m_wakeups.load(std::memory_order_relaxed) << "\n";
+            out << "spurious_wakeups " << m_spurious_wakeups.load(std::memory_order_relaxed) << "\n";
+            return out.str();
+        }
+
+        std::string toJson() const
+        {
+            std::ostringstream out;
+            out << "{\"phases\":{";
+            for (std::size_t i = 0; i < PHASE_COUNT; ++i) {
+                const Histogram& histogram = m_phases[i];
+                out << (i ? "," : "") << "\"" << phaseName(static_cast<Phase>(i)) << "\":{\"count\":" << histogram.count()
+                    << ",\"mean_ns\":" << mean(histogram) << ",\"p50_ns\":" << histogram.percentile(0.5)
+                    << ",\"p90_ns\":" << histogram.percentile(0.9) << ",\"p99_ns\":" << histogram.percentile(0.99)
+                    << ",\"max_ns\":" << histogram.max() << "}";
+            }
+            out << "},\"transfers\":" << m_throughput.count();
+            out << ",\"bytes_received\":" << m_bytes_received.load(std::memory_order_relaxed);
+            out << ",\"bytes_sent\":" << m_bytes_sent.load(std::memory_order_relaxed);
+            out << ",\"throughput_bytes_per_second\":{\"p50\":" << m_throughput.percentile(0.5) << ",\"p99\":" << m_throughput.percentile(0.99) << ",\"max\":" << m_throughput.max() << "}";
+            out << ",\"wakeups\":" << m_wakeups.load(std::memory_order_relaxed);
+            out << ",\"spurious_wakeups\":" << m_spurious_wakeups.load(std::memory_order_relaxed);
+            out << "}";
+            return out.str();
+        }
+
+    private:
+        static double mean(const Histogram& histogram)
+        {
+            return histogram.count() ? static_cast<double>(histogram.sum()) / histogram.count() : 0.0;
+        }
+
+        void recordThroughput(std::uint64_t bytes, std::chrono::nanoseconds duration)
+        {
+            if (duration.count() > 0) {
+                m_throughput.record(static_cast<std::uint64_t>(bytes * 1e9 / duration.count()));
+            }
+        }
+
+        std::array<Histogram, PHASE_COUNT> m_phases;
+        Histogram m_throughput;
+        std::atomic<std::uint64_t> m_bytes_received{0};
+        std::atomic<std::uint64_t> m_bytes_sent{0};
+        std::atomic<std::uint64_t> m_wakeups{0};
+        std::atomic<std::uint64_t> m_spurious_wakeups{0};
+    };
+
+    // Monotonic start and duration of each phase of one connection or transfer.
+    class PhaseTimeline {
+    public:
+        void begin(Phase phase)
+        {
+            m_start[static_cast<std::size_t>(phase)] = std::chrono::steady_clock::now();
+        }
+
+        // Records the time since begin(phase) here and, while recording, in TransferStats::global().
+        std::chrono::nanoseconds end(Phase phase)
+        {
+            std::size_t i = static_cast<std::size_t>(phase);
+            m_duration[i] = std::chrono::steady_clock::now() - m_start[i];
+            if (m_recording) {
+                TransferStats::global().recordPhase(phase, m_duration[i]);
+            }
+            return m_duration[i];
+        }
+
+        // Without recording the durations are only kept here.
+        void setRecording(bool recording)
+        {
+            m_recording = recording;
+        }
+
+        std::chrono::nanoseconds duration(Phase phase) const
+        {
+            return m_duration[static_cast<std::size_t>(phase)];
+        }
+
+    private:
+        std::array<std::chrono::steady_clock::time_point, PHASE_COUNT> m_start{};
+        std::array<std::chrono::nanoseconds, PHASE_COUNT> m_duration{};
+        bool m_recording = true;
+    };
+
+}
+
+#endif
@@ -0,0 +1,52 @@
+// X11Error.hpp
+
+#pragma once
+#ifndef X11Error_HEADER
+#define X11Error_HEADER
+
+#include <string>
+
+#include <boost/system/error_code.hpp>
+
+namespace X11Wrapper {
+
+    enum class Error {
+        ConnectionFailed = 1,
+        ConversionFailed,
+        PropertyFailed,
+        ExtensionMissing,
+    };
+
+    class X11Category : public boost::system::error_category {
+    public:
+        const char* name() const noexcept override
+        {
+            return "x11";
+        }
+
+        std::string message(int ev) const override
+        {
+            switch (static_cast<Error>(ev)) {
+                case Error::ConnectionFailed: return "could not open X display";
+                case Error::ConversionFailed: return "request failed, e.g. owner can't convert to the target format";
+                case Error::PropertyFailed: return "could not read the selection property";
+                case Error::ExtensionMissing: return "the X server lacks the XFixes extension";
+                default: return "x11 error " + std::to_string(ev);
+            }
+        }
+    };
+
+    inline const boost::system::error_category& x11Category()
+    {
+        static X11Category category;
+        return category;
+    }
+
+    inline boost::system::error_code makeErrorCode(Error error)
+    {
+        return boost::system::error_code(static_cast<int>(error), x11Category());
+    }
+
+}
+
+#endif
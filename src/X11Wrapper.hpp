@@ -12,73 +12,690 @@
 #include <condition_variable>
 #include <type_traits>
 #include <chrono>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <map>
+#include <vector>
+#include <cstdint>
+#include <cassert>
+#include <atomic>
+#include <algorithm>
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
+#include <X11/extensions/Xfixes.h>
 #include <boost/asio.hpp>
 
+#include "X11Error.hpp"
+#include "FdDriver.hpp"
+
+#define PROPERTY_READ_LONGS 0x10000
+#define SELECTION_TIMEOUT 5000
+#define INCR_REQUEST_OVERHEAD 64
+
 namespace X11Wrapper {
-    // source: https://stackoverflow.com/questions/27378318/c-get-string-from-clipboard-on-linux 
+    // Receives the selection in order, one piece per call.
+    using SelectionSink = std::function<void(std::string_view)>;
+
+    namespace impl {
+        // An Xlib display as FdDriver sees it, Xlib may already hold queued events the fd will not signal again.
+        struct DisplayProtocol {
+            Display* const* display;
+
+            FdDriver::Direction direction() const
+            {
+                return FdDriver::Direction::Read;
+            }
+
+            bool pending() const
+            {
+                return *display && XEventsQueued(*display, QueuedAlready) > 0;
+            }
+        };
+
+        using DisplayDriver = FdDriver::Driver<DisplayProtocol, boost::asio::posix::stream_descriptor, boost::asio::io_context::strand>;
+
+        // Atoms interned once per display connection.
+        class AtomCache {
+        public:
+            Atom get(Display* display, const std::string& name)
+            {
+                auto it = m_atoms.find(name);
+                if (it == m_atoms.end()) {
+                    it = m_atoms.emplace(name, XInternAtom(display, name.c_str(), False)).first;
+                }
+                return it->second;
+            }
+
+        private:
+            std::map<std::string, Atom> m_atoms;
+        };
+
+        // A conversion in flight, the owner stores the data in property on the reader's window.
+        struct Conversion {
+            Atom target;
+            Atom property;
+            // order of the requests, a refused conversion names the target but not the property
+            std::uint64_t sequence;
+            SelectionSink sink;
+            std::function<void(const boost::system::error_code&)> handler;
+            // fails the request if the owner goes quiet, e.g. it exits halfway through INCR
+            std::unique_ptr<boost::asio::steady_timer> timer;
+            bool incr = false;
+        };
+
+        // Display connection of a ClipboardReader, every handler holds it so it outlives the reader until they ran.
+        class ReaderState : public std::enable_shared_from_this<ReaderState> {
+        public:
+            explicit ReaderState(boost::asio::io_context& ioc) :
+                m_ioc(ioc),
+                m_strand(ioc),
+                m_stream_descriptor(ioc),
+                m_driver(DisplayProtocol{&m_display}, m_stream_descriptor, &m_strand)
+            {
+            }
+
+            ~ReaderState()
+            {
+                close();
+            }
+
+            boost::system::error_code open()
+            {
+                m_display = XOpenDisplay(NULL);
+                if (!m_display) {
+                    return makeErrorCode(Error::ConnectionFailed);
+                }
+                unsigned long color = BlackPixel(m_display, DefaultScreen(m_display));
+                m_window = XCreateSimpleWindow(m_display, DefaultRootWindow(m_display), 0, 0, 1, 1, 0, color, color);
+                // INCR chunks are announced with PropertyNotify on our window
+                XSelectInput(m_display, m_window, PropertyChangeMask);
+                m_sel = XInternAtom(m_display, "CLIPBOARD", False);
+                m_incr = XInternAtom(m_display, "INCR", False);
+                m_stream_descriptor.assign(ConnectionNumber(m_display));
+                return boost::system::error_code();
+            }
+
+            boost::asio::io_context::strand& strand()
+            {
+                return m_strand;
+            }
+
+            // Call changed whenever the clipboard gets a new owner, through the XFixes extension.
+            boost::system::error_code watchOwner(std::function<void()> changed)
+            {
+                int error_base;
+                if (!m_display || !XFixesQueryExtension(m_display, &m_fixes_event_base, &error_base)) {
+                    return makeErrorCode(Error::ExtensionMissing);
+                }
+                m_owner_changed = std::move(changed);
+                XFixesSelectSelectionInput(m_display, m_window, m_sel, XFixesSetSelectionOwnerNotifyMask | XFixesSelectionWindowDestroyNotifyMask | XFixesSelectionClientCloseNotifyMask);
+                XFlush(m_display);
+                waitEvents();
+                return boost::system::error_code();
+            }
+
+            void read(const std::string& target, SelectionSink sink, std::function<void(const boost::system::error_code&)> handler)
+            {
+                assert(m_strand.running_in_this_thread());
+                if (!m_display) {
+                    // on the strand like every other completion, a MonitorState updates its cache from there
+                    boost::asio::post(boost::asio::bind_executor(m_strand, [handler = std::move(handler)]() {
+                        handler(boost::asio::error::operation_aborted);
+                    }));
+                    return;
+                }
+                auto request = std::make_shared<Conversion>();
+                request->target = m_atoms.get(m_display, target);
+                request->property = acquireProperty();
+                request->sequence = ++m_sequence;
+                request->sink = std::move(sink);
+                request->handler = std::move(handler);
+                request->timer = std::make_unique<boost::asio::steady_timer>(m_ioc);
+                m_requests[request->property] = request;
+
+                XConvertSelection(m_display, m_sel, request->target, request->property, m_window, CurrentTime);
+                XFlush(m_display);
+                restartTimer(request);
+                waitEvents();
+            }
+
+            // Close the display, requests still running complete with operation_aborted.
+            void close()
+            {
+                if (!m_display) {
+                    return;
+                }
+                // XCloseDisplay closes the fd
+                m_stream_descriptor.release();
+                XDestroyWindow(m_display, m_window);
+                XCloseDisplay(m_display);
+                m_display = nullptr;
+                m_owner_changed = nullptr;
+                for (auto& [property, request] : m_requests) {
+                    request->timer->cancel();
+                    boost::asio::post(boost::asio::bind_executor(m_strand, [handler = std::move(request->handler)]() {
+                        handler(boost::asio::error::operation_aborted);
+                    }));
+                }
+                m_requests.clear();
+            }
+
+        private:
+            boost::asio::io_context& m_ioc;
+            boost::asio::io_context::strand m_strand;
+            boost::asio::posix::stream_descriptor m_stream_descriptor;
+            DisplayDriver m_driver;
+            FdDriver::WaitStats m_wait_stats;
+            Display* m_display = nullptr;
+            Window m_window = 0;
+            Atom m_sel;
+            Atom m_incr;
+            AtomCache m_atoms;
+            // each request in flight has its own property, so conversions can overlap
+            std::vector<Atom> m_free_properties;
+            std::size_t m_property_count = 0;
+            std::map<Atom, std::shared_ptr<Conversion>> m_requests;
+            std::uint64_t m_sequence = 0;
+            bool m_waiting = false;
+            int m_fixes_event_base = 0;
+            std::function<void()> m_owner_changed;
+
+            Atom acquireProperty()
+            {
+                if (m_free_properties.empty()) {
+                    return m_atoms.get(m_display, "XSEL_DATA" + std::to_string(m_property_count++));
+                }
+                Atom property = m_free_properties.back();
+                m_free_properties.pop_back();
+                return property;
+            }
+
+            void waitEvents()
+            {
+                if (m_waiting) {
+                    return;
+                }
+                m_waiting = true;
+                m_driver.wait(m_wait_stats, [self = shared_from_this()](const boost::system::error_code& error) {
+                    if (error) {
+                        return;
+                    }
+                    self->readEvents();
+                });
+            }
+
+            void readEvents()
+            {
+                m_waiting = false;
+                // a handler may close the reader
+                while (m_display && XPending(m_display)) {
+                    XEvent ev;
+                    XNextEvent(m_display, &ev);
+                    if (ev.type == SelectionNotify && ev.xselection.requestor == m_window && ev.xselection.selection == m_sel) {
+                        selectionNotify(ev.xselection);
+                    }
+                    else if (ev.type == PropertyNotify && ev.xproperty.state == PropertyNewValue) {
+                        auto it = m_requests.find(ev.xproperty.atom);
+                        if (it != m_requests.end() && it->second->incr) {
+                            incrChunk(it->second);
+                        }
+                    }
+                    else if (m_owner_changed && ev.type == m_fixes_event_base + XFixesSelectionNotify) {
+                        if (reinterpret_cast<XFixesSelectionNotifyEvent&>(ev).selection == m_sel) {
+                            m_owner_changed();
+                        }
+                    }
+                }
+                // owner changes arrive at any time, conversions only while one is in flight
+                if (m_display && (m_owner_changed || !m_requests.empty())) {
+                    waitEvents();
+                }
+            }
+
+            void selectionNotify(const XSelectionEvent& event)
+            {
+                std::shared_ptr<Conversion> request;
+                if (event.property == None) {
+                    // refused, the oldest request for the target is the one answered
+                    for (auto& [property, pending] : m_requests) {
+                        if (pending->target == event.target && !pending->incr && (!request || pending->sequence < request->sequence)) {
+                            request = pending;
+                        }
+                    }
+                    if (request) {
+                        finish(request, makeErrorCode(Error::ConversionFailed));
+                    }
+                    return;
+                }
+                auto it = m_requests.find(event.property);
+                if (it == m_requests.end()) {
+                    return;
+                }
+                request = it->second;
+                boost::system::error_code ec;
+                drainProperty(*request, ec);
+                if (ec || !request->incr) {
+                    finish(request, ec);
+                    return;
+                }
+                // reading the INCR property deleted it, which asks the owner for the first chunk
+                XFlush(m_display);
+                restartTimer(request);
+            }
+
+            void incrChunk(std::shared_ptr<Conversion> request)
+            {
+                boost::system::error_code ec;
+                std::size_t size = drainProperty(*request, ec);
+                if (ec || size == 0) {
+                    // a zero length chunk ends the transfer
+                    finish(request, ec);
+                    return;
+                }
+                XFlush(m_display);
+                restartTimer(request);
+            }
+
+            // Pass the property to the sink PROPERTY_READ_LONGS at a time and delete it, returns the bytes passed.
+            // The first read of a request also tells whether the owner switched to INCR.
+            std::size_t drainProperty(Conversion& request, boost::system::error_code& ec)
+            {
+                std::size_t total = 0;
+                long offset = 0;
+                for (;;) {
+                    Atom type;
+                    int format;
+                    unsigned long items, after;
+                    unsigned char* data = nullptr;
+                    // the property is deleted with the read that reaches its end
+                    if (XGetWindowProperty(m_display, m_window, request.property, offset, PROPERTY_READ_LONGS, True, AnyPropertyType, &type, &format, &items, &after, &data) != Success) {
+                        ec = makeErrorCode(Error::PropertyFailed);
+                        return total;
+                    }
+                    if (type == m_incr && !request.incr) {
+                        // the data is a lower bound of the size, the chunks follow
+                        request.incr = true;
+                        if (data) {
+                            XFree(data);
+                        }
+                        return total;
+                    }
+                    // Xlib returns 32 bit items as longs
+                    std::size_t size = items * (format == 32 ? sizeof(long) : format / 8);
+                    if (size > 0) {
+                        request.sink(std::string_view(reinterpret_cast<const char*>(data), size));
+                    }
+                    if (data) {
+                        XFree(data);
+                    }
+                    total += size;
+                    offset += items * format / 32;
+                    if (after == 0) {
+                        return total;
+                    }
+                }
+            }
+
+            void restartTimer(std::shared_ptr<Conversion> request)
+            {
+                request->timer->expires_after(std::chrono::milliseconds(SELECTION_TIMEOUT));
+                request->timer->async_wait(boost::asio::bind_executor(m_strand, [self = shared_from_this(), weak = std::weak_ptr<Conversion>(request)](const boost::system::error_code& error) {
+                    auto request = weak.lock();
+                    if (!error && request && self->m_display) {
+                        self->finish(request, boost::asio::error::timed_out);
+                    }
+                }));
+            }
+
+            void finish(std::shared_ptr<Conversion> request, const boost::system::error_code& ec)
+            {
+                m_requests.erase(request->property);
+                request->timer->cancel();
+                if (!ec) {
+                    m_free_properties.push_back(request->property);
+                }
+                else {
+                    // a late answer could still land in the property, so it is not reused
+                    XDeleteProperty(m_display, m_window, request->property);
+                }
+                request->handler(ec);
+            }
+        };
+    }
+
+    // Reads the clipboard over one long lived display connection, each read costs a conversion round trip.
+    class ClipboardReader {
+    public:
+        explicit ClipboardReader(boost::asio::io_context& ioc) :
+            m_state(std::make_shared<impl::ReaderState>(ioc))
+        {
+            if (m_state->open()) {
+                throw std::runtime_error("Could not open X display");
+            }
+        }
+
+        ClipboardReader(boost::asio::io_context& ioc, boost::system::error_code& ec) :
+            m_state(std::make_shared<impl::ReaderState>(ioc))
+        {
+            ec = m_state->open();
+        }
+
+        ClipboardReader(const ClipboardReader&) = delete;
+        ClipboardReader& operator=(const ClipboardReader&) = delete;
+
+        ~ClipboardReader()
+        {
+            close();
+        }
+
+        // Convert the clipboard to target and pass the data to sink as it arrives, then call handler(ec).
+        // Large selections are streamed with the INCR protocol, so memory stays bounded by PROPERTY_READ_LONGS.
+        // Reads may overlap, each is answered separately.
+        template <class Handler>
+        void asyncRead(const std::string& target, SelectionSink sink, Handler&& handler)
+        {
+            boost::asio::post(boost::asio::bind_executor(m_state->strand(), [state = m_state, target, sink = std::move(sink), handler = std::forward<Handler>(handler)]() mutable {
+                state->read(target, std::move(sink), std::move(handler));
+            }));
+        }
+
+        // Collect the clipboard converted to target, then call handler(ec, data).
+        template <class Handler>
+        void asyncRead(const std::string& target, Handler&& handler)
+        {
+            auto data = std::make_shared<std::string>();
+            asyncRead(target, [data](std::string_view chunk) {
+                data->append(chunk);
+            }, [data, handler = std::forward<Handler>(handler)](const boost::system::error_code& ec) mutable {
+                handler(ec, std::move(*data));
+            });
+        }
+
+        void close()
+        {
+            boost::asio::post(boost::asio::bind_executor(m_state->strand(), [state = m_state]() {
+                state->close();
+            }));
+        }
+
+    private:
+        std::shared_ptr<impl::ReaderState> m_state;
+    };
+
+    namespace impl {
+        // Clipboard content cached per target for a ClipboardMonitor, runs on the reader's strand.
+        class MonitorState : public std::enable_shared_from_this<MonitorState> {
+        public:
+            using GetHandler = std::function<void(const boost::system::error_code&, const std::string&)>;
+
+            MonitorState(boost::asio::io_context& ioc, std::shared_ptr<ReaderState> reader) :
+                m_ioc(ioc),
+                m_reader(std::move(reader))
+            {
+            }
+
+            boost::system::error_code start()
+            {
+                return m_reader->watchOwner([weak = weak_from_this()]() {
+                    if (auto self = weak.lock()) {
+                        self->ownerChanged();
+                    }
+                });
+            }
+
+            void setChangeHandler(std::function<void()> handler)
+            {
+                m_change_handler = std::move(handler);
+            }
+
+            void get(const std::string& target, GetHandler handler)
+            {
+                auto& entry = m_cache[target];
+                if (entry.generation == m_generation) {
+                    boost::asio::post(m_ioc, [data = entry.data, handler = std::move(handler)]() {
+                        handler(boost::system::error_code(), *data);
+                    });
+                    return;
+                }
+                // concurrent gets share one conversion
+                entry.waiters.push_back(std::move(handler));
+                if (!entry.fetching) {
+                    fetch(target);
+                }
+            }
+
+            void close()
+            {
+                m_change_handler = nullptr;
+                m_reader->close();
+            }
+
+        private:
+            struct Entry {
+                // generation of the owner the data came from, 0 if never fetched
+                std::uint64_t generation = 0;
+                std::shared_ptr<const std::string> data;
+                bool fetching = false;
+                std::vector<GetHandler> waiters;
+            };
+
+            boost::asio::io_context& m_ioc;
+            std::shared_ptr<ReaderState> m_reader;
+            std::map<std::string, Entry> m_cache;
+            // bumped by every owner change, cached entries of older generations are stale
+            std::uint64_t m_generation = 1;
+            std::function<void()> m_change_handler;
+
+            void fetch(const std::string& target)
+            {
+                m_cache[target].fetching = true;
+                auto data = std::make_shared<std::string>();
+                m_reader->read(target, [data](std::string_view chunk) {
+                    data->append(chunk);
+                }, [self = shared_from_this(), target, generation = m_generation, data](const boost::system::error_code& ec) {
+                    self->fetched(target, generation, ec, std::move(data));
+                });
+            }
+
+            void fetched(const std::string& target, std::uint64_t generation, const boost::system::error_code& ec, std::shared_ptr<const std::string> data)
+            {
+                auto& entry = m_cache[target];
+                entry.fetching = false;
+                if (!ec && generation != m_generation) {
+                    // the owner changed while converting, the data may already be stale
+                    fetch(target);
+                    return;
+                }
+                if (!ec) {
+                    entry.generation = generation;
+                    entry.data = data;
+                }
+                auto waiters = std::move(entry.waiters);
+                entry.waiters.clear();
+                static const std::string empty;
+                for (auto& waiter : waiters) {
+                    waiter(ec, ec ? empty : *data);
+                }
+            }
+
+            void ownerChanged()
+            {
+                ++m_generation;
+                if (m_change_handler) {
+                    m_change_handler();
+                }
+            }
+        };
+    }
+
+    // Watches the clipboard owner with XFixes and keeps the content per target cached, so it is only
+    // converted again after the owner changed.
+    class ClipboardMonitor {
+    public:
+        explicit ClipboardMonitor(boost::asio::io_context& ioc)
+        {
+            boost::system::error_code ec;
+            open(ioc, ec);
+            if (ec) {
+                throw boost::system::system_error(ec, "Could not monitor the clipboard");
+            }
+        }
+
+        ClipboardMonitor(boost::asio::io_context& ioc, boost::system::error_code& ec)
+        {
+            open(ioc, ec);
+        }
+
+        ClipboardMonitor(const ClipboardMonitor&) = delete;
+        ClipboardMonitor& operator=(const ClipboardMonitor&) = delete;
+
+        ~ClipboardMonitor()
+        {
+            close();
+        }
+
+        // handler() is called each time the clipboard gets a new owner.
+        template <class Handler>
+        void setChangeHandler(Handler&& handler)
+        {
+            boost::asio::post(boost::asio::bind_executor(m_reader->strand(), [state = m_state, handler = std::forward<Handler>(handler)]() mutable {
+                state->setChangeHandler(std::move(handler));
+            }));
+        }
+
+        // handler(ec, data) with the clipboard converted to target, from the cache unless the owner changed.
+        template <class Handler>
+        void asyncGet(const std::string& target, Handler&& handler)
+        {
+            boost::asio::post(boost::asio::bind_executor(m_reader->strand(), [state = m_state, target, handler = std::forward<Handler>(handler)]() mutable {
+                state->get(target, std::move(handler));
+            }));
+        }
+
+        void close()
+        {
+            boost::asio::post(boost::asio::bind_executor(m_reader->strand(), [state = m_state]() {
+                state->close();
+            }));
+        }
+
+    private:
+        std::shared_ptr<impl::ReaderState> m_reader;
+        std::shared_ptr<impl::MonitorState> m_state;
+
+        void open(boost::asio::io_context& ioc, boost::system::error_code& ec)
+        {
+            m_reader = std::make_shared<impl::ReaderState>(ioc);
+            m_state = std::make_shared<impl::MonitorState>(ioc, m_reader);
+            ec = m_reader->open();
+            if (!ec) {
+                ec = m_state->start();
+            }
+        }
+    };
+
+    // One shot read over a connection of its own, prefer a ClipboardReader for repeated reads.
+    template <class Handler>
+    void asyncReadImpl(boost::asio::io_context& ioc, const std::string& target, SelectionSink sink, Handler&& handler)
+    {
+        boost::system::error_code ec;
+        auto reader = std::make_shared<ClipboardReader>(ioc, ec);
+        if (ec) {
+            boost::asio::post(ioc, [ec, handler = std::forward<Handler>(handler)]() mutable {
+                handler(ec);
+            });
+            return;
+        }
+        // the reader is closed once the handler is released
+        reader->asyncRead(target, std::move(sink), [reader, handler = std::forward<Handler>(handler)](const boost::system::error_code& ec) mutable {
+            handler(ec);
+        });
+    }
+
+    template <class Handler>
+    void asyncReadImpl(boost::asio::io_context& ioc, SelectionSink sink, Handler&& handler)
+    {
+        asyncReadImpl(ioc, "UTF8_STRING", std::move(sink), std::forward<Handler>(handler));
+    }
+
+    // Blocking read of the clipboard as UTF-8, throws boost::system::system_error if it fails.
     inline std::string readImpl()
     {
-        Display* display = NULL;
-        char* display_name = NULL;
-        const char* bufname = "CLIPBOARD";
-        const char* fmtname = "UTF8_STRING";
-        if(!(display = XOpenDisplay(display_name))) {
-            throw std::runtime_error("Error XOpenDisplay\n");
-        }
-        unsigned long color = BlackPixel(display, DefaultScreen(display));
-        Window window = XCreateSimpleWindow(display, DefaultRootWindow(display), 0, 0, 1, 1, 0, color, color);
-        char *result;
-        unsigned long ressize, restail;
-        int resbits;
-        Atom bufid = XInternAtom(display, bufname, False),
-            fmtid = XInternAtom(display, fmtname, False),
-            propid = XInternAtom(display, "XSEL_DATA", False),
-            incrid = XInternAtom(display, "INCR", False);
-        XEvent event;
-        XConvertSelection(display, bufid, fmtid, propid, window, CurrentTime);
-        do {
-            XNextEvent(display, &event);
-        } while (event.type != SelectionNotify || event.xselection.selection != bufid);
-        if (event.xselection.property) {
-            XGetWindowProperty(
-                display, 
-                window, 
-                propid, 
-                0, 
-                LONG_MAX / 4, 
-                False, 
-                AnyPropertyType,
-                &fmtid, 
-                &resbits, 
-                &ressize, 
-                &restail, 
-                (unsigned char**)&result
-            );
-            if (fmtid == incrid) {
-                XDestroyWindow(display, window);
-                XCloseDisplay(display);
-                throw std::runtime_error("Buffer is too large and INCR reading is not implemented yet.\n");
-            }
-            std::string res(result, ressize);
-            XFree(result);
-            XDestroyWindow(display, window);
-            XCloseDisplay(display);
-            return res;
-        }
-        else {
-            XDestroyWindow(display, window);
-            XCloseDisplay(display);
-            throw std::runtime_error("request failed, e.g. owner can't convert to the target format");   
+        boost::asio::io_context ioc;
+        std::string result;
+        boost::system::error_code error;
+        asyncReadImpl(ioc, [&result](std::string_view chunk) {
+            result.append(chunk);
+        }, [&error](const boost::system::error_code& ec) {
+            error = ec;
+        });
+        ioc.run();
+        if (error) {
+            throw boost::system::system_error(error, "Reading the clipboard failed");
         }
+        return result;
     }
 
+    // Targets a ClipboardWriter publishes, e.g. "UTF8_STRING", "text/html" or "image/png".
+    class ClipboardContent {
+    public:
+        // Called with a continuation taking an error or the data, which may be called later and from any thread,
+        // also after the writer is gone as long as its io_context exists. On error the waiting requestors are refused and the next request tries again.
+        using ProducerDone = std::function<void(const boost::system::error_code&, std::string)>;
+        using Producer = std::function<void(ProducerDone)>;
+
+        // Text under UTF8_STRING, STRING and text/plain;charset=utf-8, all sharing one buffer.
+        static ClipboardContent text(std::string msg)
+        {
+            ClipboardContent content;
+            auto data = std::make_shared<const std::string>(std::move(msg));
+            content.add("UTF8_STRING", data);
+            content.add("STRING", data);
+            content.add("text/plain;charset=utf-8", data);
+            return content;
+        }
+
+        void add(const std::string& target, std::string data)
+        {
+            add(target, std::make_shared<const std::string>(std::move(data)));
+        }
+
+        void add(const std::string& target, std::shared_ptr<const std::string> data)
+        {
+            m_targets.push_back(Target{target, std::move(data), nullptr});
+        }
+
+        // Only converted when a requestor first asks for target, the result then serves every later request.
+        void addLazy(const std::string& target, Producer producer)
+        {
+            m_targets.push_back(Target{target, nullptr, std::move(producer)});
+        }
+
+    private:
+        friend class ClipboardWriter;
+
+        struct Target {
+            std::string name;
+            std::shared_ptr<const std::string> data;
+            Producer producer;
+        };
+        std::vector<Target> m_targets;
+    };
+
+    struct WriterStats {
+        // times the X fd woke the writer up
+        std::uint64_t wakeups = 0;
+        std::uint64_t events = 0;
+        std::uint64_t requests = 0;
+    };
+
     class ClipboardWriter {
     public:
         ClipboardWriter(boost::asio::io_context & ioc) :
             m_strand(ioc),
-            m_stream_descriptor(ioc)
+            m_stream_descriptor(ioc),
+            m_driver(impl::DisplayProtocol{&m_display}, m_stream_descriptor, &m_strand)
         {
             m_display = XOpenDisplay(NULL);
             if (!m_display) {
@@ -92,9 +709,15 @@ namespace X11Wrapper {
             m_owner = XCreateSimpleWindow(m_display, m_root, -10, -10, 1, 1, 0, 0, 0);
 
             m_sel = XInternAtom(m_display, "CLIPBOARD", False);
-            m_utf8 = XInternAtom(m_display, "UTF8_STRING", False);
-            m_string = XInternAtom(m_display, "STRING", False);
             m_targets = XInternAtom(m_display, "TARGETS", False);
+            m_incr = XInternAtom(m_display, "INCR", False);
+
+            // messages that do not fit one ChangeProperty request are served in chunks with INCR
+            long max_request = XExtendedMaxRequestSize(m_display);
+            if (max_request == 0) {
+                max_request = XMaxRequestSize(m_display);
+            }
+            m_chunk_size = static_cast<std::size_t>(max_request) * 4 - INCR_REQUEST_OVERHEAD;
             
             int fd = ConnectionNumber(m_display);
             if (fd < 0) {
@@ -107,8 +730,11 @@ namespace X11Wrapper {
         void close(Handler&& handler)
         {
             boost::asio::post(m_stream_descriptor.get_executor(), boost::asio::bind_executor(m_strand, [handler = std::forward<Handler>(handler), this] {
-                killX11();    
-                m_stream_descriptor.cancel();
+                // a completion the driver already posted sees the failure instead of the closed display
+                m_driver.fail(boost::asio::error::operation_aborted);
+                // XCloseDisplay closes the fd, releasing it also cancels the pending wait
+                m_stream_descriptor.release();
+                killX11();
                 handler();
             }));
         }
@@ -118,33 +744,92 @@ namespace X11Wrapper {
             close([](){});
         }
 
+        // Own the clipboard with content, handler() is called once the selection is ours.
         template <class Handler>
-        void setMsg(std::string&& msg, Handler&& handler)
+        void setContent(ClipboardContent&& content, Handler&& handler)
         {
-            boost::asio::post(m_stream_descriptor.get_executor(), boost::asio::bind_executor(m_strand, [msg = std::move(msg), handler = std::move(handler), this]() {
-                m_stream_descriptor.cancel();
-                m_msg = std::move(msg);
+            boost::asio::post(m_stream_descriptor.get_executor(), boost::asio::bind_executor(m_strand, [content = std::move(content), handler = std::move(handler), this]() mutable {
+                // INCR transfers and conversions in flight keep the targets they started with
+                m_content.clear();
+                for (auto& target : content.m_targets) {
+                    auto published = std::make_shared<PublishedTarget>();
+                    published->atom = m_atoms.get(m_display, target.name);
+                    published->data = std::move(target.data);
+                    published->producer = std::move(target.producer);
+                    m_content[published->atom] = std::move(published);
+                }
                 aquireX11SelectionOwnership(std::move(handler));
             }));
         }
 
+        void setContent(ClipboardContent&& content)
+        {
+            setContent(std::move(content), [](){});
+        }
+
+        template <class Handler>
+        void setMsg(std::string&& msg, Handler&& handler)
+        {
+            setContent(ClipboardContent::text(std::move(msg)), std::forward<Handler>(handler));
+        }
+
         void setMsg(std::string&& msg)
         {
             setMsg(std::move(msg), [](){});
         }
 
+        // Safe to call from any thread.
+        WriterStats stats() const
+        {
+            WriterStats stats;
+            stats.wakeups = m_wakeups.load(std::memory_order_relaxed);
+            stats.events = m_events.load(std::memory_order_relaxed);
+            stats.requests = m_requests.load(std::memory_order_relaxed);
+            return stats;
+        }
+
     private:
         Display* m_display;
         Window m_owner;
         Window m_root;
         int m_screen;
         Atom m_sel;
-        Atom m_utf8;
-        Atom m_string;
         Atom m_targets;
+        Atom m_incr;
         boost::asio::io_context::strand m_strand;
         boost::asio::posix::stream_descriptor m_stream_descriptor;
-        std::string m_msg;
+        impl::DisplayDriver m_driver;
+        FdDriver::WaitStats m_wait_stats;
+        bool m_waiting = false;
+        std::size_t m_chunk_size;
+
+        // A target of the current content, a lazy one queues the requests that arrive while its producer runs.
+        struct PublishedTarget {
+            Atom atom;
+            std::shared_ptr<const std::string> data;
+            ClipboardContent::Producer producer;
+            bool producing = false;
+            std::vector<XSelectionRequestEvent> waiting;
+        };
+        std::map<Atom, std::shared_ptr<PublishedTarget>> m_content;
+        impl::AtomCache m_atoms;
+        bool m_owned = false;
+
+        // A message served in chunks, the next one is written each time the requestor deletes the property.
+        struct IncrTransfer {
+            std::shared_ptr<const std::string> msg;
+            Atom type;
+            std::size_t offset = 0;
+            // the zero length chunk that ends the transfer was written
+            bool finished = false;
+        };
+        // by requestor window and property
+        std::map<std::pair<Window, Atom>, IncrTransfer> m_transfers;
+        std::atomic<std::uint64_t> m_wakeups{0};
+        std::atomic<std::uint64_t> m_events{0};
+        std::atomic<std::uint64_t> m_requests{0};
+        // expires with the writer, producer continuations check it before touching the writer
+        std::shared_ptr<ClipboardWriter*> m_self = std::make_shared<ClipboardWriter*>(this);
     
         template <class Handler>
         void aquireX11SelectionOwnership(Handler&& handler)
@@ -154,11 +839,11 @@ namespace X11Wrapper {
 
             /* Claim ownership of the clipboard. */
             XSetSelectionOwner(m_display, m_sel, m_owner, CurrentTime);
-            m_stream_descriptor.async_wait(m_stream_descriptor.wait_write, boost::asio::bind_executor(m_strand, 
-                [handler = std::move(handler), this](const boost::system::error_code& error){
-                    writeHandler(error, std::move(handler));
-                }
-            ));
+            XFlush(m_display);
+            m_owned = true;
+            // the selection is ours, requests are served from here on
+            waitEvents();
+            handler();
         }
 
         void killX11()
@@ -166,148 +851,191 @@ namespace X11Wrapper {
             XDestroyWindow(m_display, m_owner);
             XDestroyWindow(m_display, m_root);
             XCloseDisplay(m_display);
+            m_display = nullptr;
         }
 
-        template <class Handler>
-        void writeHandler(const boost::system::error_code& error, Handler&& handler)
+        void waitEvents()
         {
-            if (error == boost::asio::error::operation_aborted) {
+            if (m_waiting) {
                 return;
             }
-            else if (error) {
+            m_waiting = true;
+            m_driver.wait(m_wait_stats, [this](const boost::system::error_code& error) {
+                if (error) {
+                    return;
+                }
+                readEvents();
+            });
+        }
+
+        void readEvents()
+        {
+            m_waiting = false;
+            if (!m_display) {
                 return;
             }
-            
-            while (XPending(m_display)) {
+            m_wakeups.fetch_add(1, std::memory_order_relaxed);
+            // Replies only go to Xlib's output buffer while the batch is handled and are flushed once at the end.
+            // Flushing can read more events into the queue, the driver sees those before waiting on the fd again.
+            while (XEventsQueued(m_display, QueuedAfterReading) > 0) {
                 XEvent ev;
                 XNextEvent(m_display, &ev);
+                dispatchEvent(ev);
             }
-            
-            m_stream_descriptor.async_wait(m_stream_descriptor.wait_read, boost::asio::bind_executor(m_strand, 
-                [handler = std::move(handler), this](const boost::system::error_code& error) {
-                    readHandler(error, std::move(handler));
-                }
-            ));
+            XFlush(m_display);
+            if (!m_owned && m_transfers.empty()) {
+                // someone else owns the clipboard now and nothing is left to finish
+                return;
+            }
+            waitEvents();
         }
 
-        template <class Handler>
-        void readHandler(const boost::system::error_code& error, Handler&& handler)
+        void dispatchEvent(XEvent& ev)
         {
-            if (error == boost::asio::error::operation_aborted) {
-                return;
+            m_events.fetch_add(1, std::memory_order_relaxed);
+            if (ev.type == SelectionClear) {
+                m_owned = false;
             }
-            else if (error) {
-                return;
+            else if (ev.type == PropertyNotify && ev.xproperty.state == PropertyDelete) {
+                sendNextChunk(ev.xproperty.window, ev.xproperty.atom);
             }
-            while (XPending(m_display)) {
-                XEvent ev;
-                XNextEvent(m_display, &ev);
-                if (ev.type == SelectionClear) {
+            else if (ev.type == DestroyNotify) {
+                // requestor went away in the middle of a transfer
+                auto it = m_transfers.lower_bound({ev.xdestroywindow.window, 0});
+                while (it != m_transfers.end() && it->first.first == ev.xdestroywindow.window) {
+                    it = m_transfers.erase(it);
+                }
+            }
+            else if (ev.type == SelectionRequest) {
+                m_requests.fetch_add(1, std::memory_order_relaxed);
+                XSelectionRequestEvent* sev = (XSelectionRequestEvent*)&ev.xselectionrequest;
+                if (sev->target == m_targets) {
+                    sendTargets(sev);
                     return;
                 }
-                else if (ev.type == SelectionRequest) {
-                    XSelectionRequestEvent* sev = (XSelectionRequestEvent*)&ev.xselectionrequest;
-                    if (sev->target == m_utf8) {
-                        sendUtf8(sev, m_utf8, m_msg);
-                    }
-                    else if (sev->target == m_string) {
-                        sendString(sev, m_string, m_msg);
-                    }
-                    else if (sev->target == m_targets) {
-                        sendTargets(sev);
-                    }
-                    else {
-                        sendNo(sev);
-                    }
+                auto it = m_content.find(sev->target);
+                if (it == m_content.end()) {
+                    sendNo(sev);
                 }
-            }
-            m_stream_descriptor.async_wait(m_stream_descriptor.wait_read, boost::asio::bind_executor(m_strand, 
-                [handler = std::move(handler), this](const boost::system::error_code& error){
-                    readHandler(error, std::move(handler));
+                else {
+                    sendTarget(sev, it->second);
                 }
-            ));
+            }
         }
 
-        void sendTargets(XSelectionRequestEvent * sev)
+        // Answer a request, the event is sent with the next flush.
+        void sendNotify(XSelectionRequestEvent *sev, Atom property)
         {
-            const Atom targets[] = {
-                m_utf8,
-                m_string,
-                m_targets
-            };
-            
             XSelectionEvent ssev;
-            time_t now_tm;
-            char *now, *an;
-            an = XGetAtomName(m_display, sev->property);
-            if (an) {
-                XFree(an);
-            }
-            XChangeProperty(m_display, sev->requestor, sev->property, XA_ATOM, 32, PropModeReplace, (unsigned char *)targets, sizeof(targets) / sizeof(targets[0]));
             ssev.type = SelectionNotify;
             ssev.requestor = sev->requestor;
             ssev.selection = sev->selection;
             ssev.target = sev->target;
-            ssev.property = sev->property;
+            ssev.property = property;
             ssev.time = sev->time;
             XSendEvent(m_display, sev->requestor, True, NoEventMask, (XEvent*)&ssev);
         }
 
+        void sendTargets(XSelectionRequestEvent * sev)
+        {
+            std::vector<Atom> targets = {m_targets};
+            for (const auto& [atom, target] : m_content) {
+                targets.push_back(atom);
+            }
+            XChangeProperty(m_display, sev->requestor, sev->property, XA_ATOM, 32, PropModeReplace, (unsigned char *)targets.data(), targets.size());
+            sendNotify(sev, sev->property);
+        }
+
         // source: https://www.uninformativ.de/blog/postings/2017-04-02/0/POSTING-en.html
         void sendNo(XSelectionRequestEvent *sev)
         {
-            XSelectionEvent ssev;
-            char *an;
-            an = XGetAtomName(m_display, sev->target);
-            if (an)
-                XFree(an);
+            /* A property of None signifies "nope". */
+            sendNotify(sev, None);
+        }
 
-            /* All of these should match the values of the request. */
-            ssev.type = SelectionNotify;
-            ssev.requestor = sev->requestor;
-            ssev.selection = sev->selection;
-            ssev.target = sev->target;
-            ssev.property = None;  /* signifies "nope" */
-            ssev.time = sev->time;
-            XSendEvent(m_display, sev->requestor, True, NoEventMask, (XEvent *)&ssev);
+        void sendTarget(XSelectionRequestEvent *sev, const std::shared_ptr<PublishedTarget> & target)
+        {
+            if (target->data) {
+                sendData(sev, target->atom, target->data);
+                return;
+            }
+            target->waiting.push_back(*sev);
+            if (target->producing) {
+                return;
+            }
+            // first request for a lazy target, the producer runs once and its result is kept for everyone after
+            target->producing = true;
+            target->producer([strand = m_strand, weak = std::weak_ptr<ClipboardWriter*>(m_self), target](const boost::system::error_code& ec, std::string data) mutable {
+                boost::asio::post(boost::asio::bind_executor(strand, [weak, target, ec, data = std::move(data)]() mutable {
+                    auto self = weak.lock();
+                    if (!self) {
+                        return;
+                    }
+                    (*self)->produced(target, ec, std::move(data));
+                }));
+            });
         }
 
-        void sendUtf8(XSelectionRequestEvent *sev, Atom utf8, const std::string & msg)
+        void produced(const std::shared_ptr<PublishedTarget>& target, const boost::system::error_code& ec, std::string data)
         {
-            XSelectionEvent ssev;
-            time_t now_tm;
-            char *now, *an;
-            an = XGetAtomName(m_display, sev->property);
-            if (an) {
-                XFree(an);
+            target->producing = false;
+            if (!ec) {
+                target->data = std::make_shared<const std::string>(std::move(data));
+                target->producer = nullptr;
             }
-            XChangeProperty(m_display, sev->requestor, sev->property, utf8, 8, PropModeReplace, (unsigned char *)msg.data(), msg.size());
-            ssev.type = SelectionNotify;
-            ssev.requestor = sev->requestor;
-            ssev.selection = sev->selection;
-            ssev.target = sev->target;
-            ssev.property = sev->property;
-            ssev.time = sev->time;
-            XSendEvent(m_display, sev->requestor, True, NoEventMask, (XEvent*)&ssev);
+            auto waiting = std::move(target->waiting);
+            target->waiting.clear();
+            if (!m_display) {
+                return;
+            }
+            for (auto& request : waiting) {
+                if (ec) {
+                    sendNo(&request);
+                }
+                else {
+                    sendData(&request, target->atom, target->data);
+                }
+            }
+            XFlush(m_display);
+            // an INCR transfer needs the requestor's events, also if the selection was lost meanwhile
+            waitEvents();
         }
 
-        void sendString(XSelectionRequestEvent *sev, Atom string, const std::string & msg)
+        void sendData(XSelectionRequestEvent *sev, Atom type, const std::shared_ptr<const std::string> & msg)
         {
-            XSelectionEvent ssev;
-            time_t now_tm;
-            char *now, *an;
-            an = XGetAtomName(m_display, sev->property);
-            if (an) {
-                XFree(an);
+            if (msg->size() > m_chunk_size) {
+                // announce INCR with the size as lower bound, the requestor deleting the property asks for the first chunk
+                long size = static_cast<long>(msg->size());
+                XSelectInput(m_display, sev->requestor, PropertyChangeMask | StructureNotifyMask);
+                XChangeProperty(m_display, sev->requestor, sev->property, m_incr, 32, PropModeReplace, (unsigned char *)&size, 1);
+                m_transfers[{sev->requestor, sev->property}] = IncrTransfer{msg, type};
             }
-            XChangeProperty(m_display, sev->requestor, sev->property, string, 8, PropModeReplace, (unsigned char *)msg.data(), msg.size());
-            ssev.type = SelectionNotify;
-            ssev.requestor = sev->requestor;
-            ssev.selection = sev->selection;
-            ssev.target = sev->target;
-            ssev.property = sev->property;
-            ssev.time = sev->time;
-            XSendEvent(m_display, sev->requestor, True, NoEventMask, (XEvent*)&ssev);
+            else {
+                XChangeProperty(m_display, sev->requestor, sev->property, type, 8, PropModeReplace, (unsigned char *)msg->data(), msg->size());
+            }
+            sendNotify(sev, sev->property);
+        }
+
+        void sendNextChunk(Window requestor, Atom property)
+        {
+            auto it = m_transfers.find({requestor, property});
+            if (it == m_transfers.end()) {
+                return;
+            }
+            IncrTransfer& transfer = it->second;
+            if (transfer.finished) {
+                m_transfers.erase(it);
+                auto next = m_transfers.lower_bound({requestor, 0});
+                if (next == m_transfers.end() || next->first.first != requestor) {
+                    XSelectInput(m_display, requestor, NoEventMask);
+                }
+                return;
+            }
+            // every transfer points into the same buffer, only the offset is per requestor
+            std::size_t size = std::min(m_chunk_size, transfer.msg->size() - transfer.offset);
+            XChangeProperty(m_display, requestor, property, transfer.type, 8, PropModeReplace, (unsigned char *)transfer.msg->data() + transfer.offset, size);
+            transfer.offset += size;
+            transfer.finished = size == 0;
         }
     };
 }
@@ -0,0 +1,217 @@
+#include <iostream>
+#include <exception>
+#include <memory>
+#include <atomic>
+#include <utility>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+
+#include <boost/version.hpp>
+#include <boost/asio.hpp>
+
+#include <sys/socket.h>
+#include <errno.h>
+
+#include "FdDriver.hpp"
+#define BENCH_COUNT_ALLOCATIONS
+#include "BenchSupport.hpp"
+
+using boost::asio::local::stream_protocol;
+
+// Stands in for a library doing its own IO, a receive returns -EAGAIN until the peer's byte arrived.
+struct ByteProtocol {
+    FdDriver::Direction direction() const
+    {
+        return FdDriver::Direction::Read;
+    }
+
+    bool pending() const
+    {
+        return false;
+    }
+
+    bool wouldBlock(int rc) const
+    {
+        return rc == -EAGAIN || rc == -EWOULDBLOCK;
+    }
+};
+
+int receiveByte(stream_protocol::socket& socket)
+{
+    char byte;
+    ssize_t rc = ::recv(socket.native_handle(), &byte, 1, 0);
+    return rc < 0 ? -errno : static_cast<int>(rc);
+}
+
+void sendByte(stream_protocol::socket& socket)
+{
+    char byte = 'x';
+    if (::send(socket.native_handle(), &byte, 1, 0) != 1) {
+        throw std::runtime_error("send failed");
+    }
+}
+
+// One end of the ping-pong, receives rounds bytes and answers each, the last one only if last_word.
+template <class Driver>
+struct DriverPlayer {
+    Driver& driver;
+    stream_protocol::socket& socket;
+    std::size_t rounds;
+    bool last_word;
+    FdDriver::WaitStats stats;
+
+    void receive()
+    {
+        driver.retry(stats, [this]() {
+            return receiveByte(socket);
+        }, [this](const boost::system::error_code& ec, int rc) {
+            if (ec || rc != 1) {
+                throw std::runtime_error("receive failed");
+            }
+            --rounds;
+            if (rounds > 0 || last_word) {
+                sendByte(socket);
+            }
+            if (rounds > 0) {
+                receive();
+            }
+        });
+    }
+};
+
+// The same ping-pong written the way the demos waited before FdDriver, one heap allocated operation per wait.
+struct PlainPlayer {
+    stream_protocol::socket& socket;
+    std::size_t rounds;
+    bool last_word;
+    FdDriver::WaitStats stats;
+
+    void receive()
+    {
+        int rc = receiveByte(socket);
+        if (rc == -EAGAIN || rc == -EWOULDBLOCK) {
+            socket.async_wait(stream_protocol::socket::wait_read, [this](const boost::system::error_code& ec) {
+                if (ec) {
+                    throw std::runtime_error(ec.message());
+                }
+                ++stats.wakeups;
+                receive();
+            });
+            return;
+        }
+        if (rc != 1) {
+            throw std::runtime_error("receive failed");
+        }
+        --rounds;
+        if (rounds > 0 || last_word) {
+            sendByte(socket);
+        }
+        if (rounds > 0) {
+            receive();
+        }
+    }
+};
+
+struct Result {
+    std::string variant;
+    std::uint64_t wakeups;
+    double seconds;
+    std::size_t allocations;
+};
+
+template <class Start>
+Result measure(const std::string& variant, boost::asio::io_context& ioc, Start&& start)
+{
+    ioc.restart();
+    std::size_t allocations = g_allocations;
+    auto begin = std::chrono::steady_clock::now();
+    auto wakeups = start();
+    ioc.run();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    return Result{variant, wakeups(), elapsed.count(), g_allocations - allocations};
+}
+
+void printResult(const Result& result, std::size_t rounds, const std::string& label)
+{
+    double wakeups = static_cast<double>(result.wakeups ? result.wakeups : 1);
+    std::cout << "{\"label\":\"" << label << "\",\"bench\":\"fd_driver\",\"variant\":\"" << result.variant << "\",\"rounds\":" << rounds
+        << ",\"wakeups\":" << result.wakeups << ",\"seconds\":" << result.seconds
+        << ",\"ns_per_wakeup\":" << result.seconds * 1e9 / wakeups << ",\"allocations_per_wakeup\":" << result.allocations / wakeups << "}" << std::endl;
+}
+
+int main(int argc, char** argv) {
+
+    std::size_t rounds = 100000;
+    std::string label;
+    for (int i = 1; i < argc; i += 2) {
+        std::string option = argv[i];
+        if (i + 1 < argc && option == "--rounds") {
+            rounds = std::strtoul(argv[i + 1], nullptr, 10);
+        }
+        else if (i + 1 < argc && option == "--label") {
+            label = argv[i + 1];
+        }
+        else {
+            rounds = 0;
+            break;
+        }
+    }
+    if (rounds == 0) {
+        std::cerr << "usage: " << argv[0] << " [--rounds 100000] [--label name]\n";
+        return EXIT_FAILURE;
+    }
+
+    try {
+        boost::asio::io_context ioc;
+        boost::asio::io_context::strand strand(ioc);
+
+        // each byte crosses the pair once, so every receive needs a real wakeup
+        stream_protocol::socket first(ioc);
+        stream_protocol::socket second(ioc);
+        boost::asio::local::connect_pair(first, second);
+        first.non_blocking(true);
+        second.non_blocking(true);
+
+        printResult(measure("plain", ioc, [&]() {
+            auto players = std::make_shared<std::pair<PlainPlayer, PlainPlayer>>(PlainPlayer{first, rounds, false, {}}, PlainPlayer{second, rounds, true, {}});
+            players->first.receive();
+            players->second.receive();
+            sendByte(first);
+            return [players]() {
+                return players->first.stats.wakeups + players->second.stats.wakeups;
+            };
+        }), rounds, label);
+
+        using Driver = FdDriver::Driver<ByteProtocol, stream_protocol::socket>;
+        Driver first_driver(ByteProtocol{}, first);
+        Driver second_driver(ByteProtocol{}, second);
+        printResult(measure("driver", ioc, [&]() {
+            auto players = std::make_shared<std::pair<DriverPlayer<Driver>, DriverPlayer<Driver>>>(DriverPlayer<Driver>{first_driver, first, rounds, false, {}}, DriverPlayer<Driver>{second_driver, second, rounds, true, {}});
+            players->first.receive();
+            players->second.receive();
+            sendByte(first);
+            return [players]() {
+                return players->first.stats.wakeups + players->second.stats.wakeups;
+            };
+        }), rounds, label);
+
+        using StrandDriver = FdDriver::Driver<ByteProtocol, stream_protocol::socket, boost::asio::io_context::strand>;
+        StrandDriver first_strand_driver(ByteProtocol{}, first, &strand);
+        StrandDriver second_strand_driver(ByteProtocol{}, second, &strand);
+        printResult(measure("driver_strand", ioc, [&]() {
+            auto players = std::make_shared<std::pair<DriverPlayer<StrandDriver>, DriverPlayer<StrandDriver>>>(DriverPlayer<StrandDriver>{first_strand_driver, first, rounds, false, {}}, DriverPlayer<StrandDriver>{second_strand_driver, second, rounds, true, {}});
+            players->first.receive();
+            players->second.receive();
+            sendByte(first);
+            return [players]() {
+                return players->first.stats.wakeups + players->second.stats.wakeups;
+            };
+        }), rounds, label);
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,334 @@
+#include <iostream>
+#include <exception>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <utility>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <algorithm>
+
+#include <boost/version.hpp>
+#include <boost/asio.hpp>
+
+#include <pwd.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Libssh2Wrapper.hpp"
+#include "BenchSupport.hpp"
+
+using boost::asio::ip::tcp;
+using BenchSupport::parseList;
+
+// Runs a program and waits for it, throws if it fails.
+void runProgram(const std::vector<std::string>& args)
+{
+    std::vector<char*> argv;
+    for (const auto& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    pid_t pid;
+    if (posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0) {
+        throw std::runtime_error("Failed to run " + args[0]);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        throw std::runtime_error(args[0] + " failed");
+    }
+}
+
+// Throwaway OpenSSH sshd on an ephemeral loopback port that only accepts a generated client key.
+class LocalSshd {
+public:
+    LocalSshd(boost::asio::io_context& ioc, const std::string& directory, const std::string& sshd) :
+        m_directory(directory)
+    {
+        std::string host_key = directory + "/host_key";
+        std::string client_key = directory + "/client_key";
+        runProgram({"ssh-keygen", "-q", "-t", "rsa", "-b", "2048", "-m", "PEM", "-N", "", "-f", host_key});
+        runProgram({"ssh-keygen", "-q", "-t", "rsa", "-b", "2048", "-m", "PEM", "-N", "", "-f", client_key});
+
+        // let the kernel pick a free port, sshd binds it right after
+        {
+            tcp::acceptor acceptor(ioc, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+            m_port = std::to_string(acceptor.local_endpoint().port());
+        }
+
+        std::string config = directory + "/sshd_config";
+        {
+            std::ofstream out(config);
+            out << "Port " << m_port << "\n"
+                << "ListenAddress 127.0.0.1\n"
+                << "HostKey " << host_key << "\n"
+                << "AuthorizedKeysFile " << client_key << ".pub\n"
+                << "PidFile " << directory << "/sshd.pid\n"
+                << "PasswordAuthentication no\n"
+                << "KbdInteractiveAuthentication no\n"
+                << "UsePAM no\n"
+                << "StrictModes no\n"
+                << "MaxStartups 1024\n"
+                << "Subsystem sftp internal-sftp\n";
+        }
+
+        m_server.start({sshd, "-D", "-e", "-f", config}, [&ioc, this]() {
+            boost::system::error_code ec;
+            tcp::socket probe(ioc);
+            probe.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), std::stoi(m_port)), ec);
+            return !ec;
+        });
+
+        m_options.port = m_port;
+        m_options.private_key_path = client_key;
+        m_options.public_key_path = client_key + ".pub";
+    }
+
+    const Libssh2Wrapper::SessionOptions& options() const
+    {
+        return m_options;
+    }
+
+private:
+    std::string m_directory;
+    std::string m_port;
+    BenchSupport::ServerProcess m_server;
+    Libssh2Wrapper::SessionOptions m_options;
+};
+
+// "a,b" -> names, "default" leaves the choice to libssh2.
+std::vector<std::string> parseNames(const std::string& list)
+{
+    std::vector<std::string> names;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        names.push_back(item == "default" ? "" : item);
+    }
+    return names;
+}
+
+// Pseudo random bytes, or log-like lines that compress well when text is set.
+void writeTestFile(const std::string& path, std::uint64_t size, bool text)
+{
+    std::ofstream out(path, std::ios::binary);
+    std::vector<char> block(1 << 20);
+    for (std::size_t i = 0; i < block.size(); ++i) {
+        block[i] = static_cast<char>((i * 2654435761u) >> 13);
+    }
+    if (text) {
+        std::string lines;
+        for (std::size_t i = 0; lines.size() < block.size(); ++i) {
+            lines += "i = " + std::to_string(i) + " yopyo tyhis is a test file with some content\n";
+        }
+        std::copy_n(lines.begin(), block.size(), block.begin());
+    }
+    for (std::uint64_t written = 0; written < size; written += block.size()) {
+        out.write(block.data(), std::min<std::uint64_t>(block.size(), size - written));
+    }
+}
+
+struct BenchConfig {
+    std::vector<std::uint64_t> sizes;
+    std::vector<std::uint64_t> concurrency;
+    std::vector<std::uint64_t> windows;
+    std::vector<std::uint64_t> chunks;
+    std::vector<std::string> kex;
+    std::vector<std::string> ciphers;
+    std::vector<std::string> macs;
+    std::vector<std::uint64_t> compress;
+    std::uint64_t threads;
+    // runs needing more destination space than this are skipped
+    std::uint64_t max_disk;
+    bool text;
+    std::string label;
+};
+
+// Every combination of the method lists and compression on top of the server's options.
+std::vector<Libssh2Wrapper::SessionOptions> sessionMatrix(const BenchConfig& config, const Libssh2Wrapper::SessionOptions& base)
+{
+    std::vector<Libssh2Wrapper::SessionOptions> matrix;
+    for (const auto& kex : config.kex) {
+        for (const auto& cipher : config.ciphers) {
+            for (const auto& mac : config.macs) {
+                for (std::uint64_t compress : config.compress) {
+                    Libssh2Wrapper::SessionOptions options = base;
+                    options.kex_methods = kex;
+                    options.cipher_methods = cipher;
+                    options.mac_methods = mac;
+                    options.compress = compress != 0;
+                    matrix.push_back(options);
+                }
+            }
+        }
+    }
+    return matrix;
+}
+
+std::string methodName(const std::string& method)
+{
+    return method.empty() ? "default" : method;
+}
+
+// One JSON line per size, session options, concurrency, read window and chunk size.
+void runBenchmarks(const BenchConfig& config, const std::string& directory, const std::string& sshd)
+{
+    boost::asio::io_context ioc;
+    LocalSshd server(ioc, directory, sshd);
+    std::string username = getpwuid(getuid())->pw_name;
+
+    for (std::uint64_t size : config.sizes) {
+        std::string source = directory + "/source_" + std::to_string(size);
+        writeTestFile(source, size, config.text);
+
+        for (const auto& session : sessionMatrix(config, server.options())) {
+            for (std::uint64_t transfers : config.concurrency) {
+                for (std::uint64_t window : config.windows) {
+                    for (std::uint64_t chunk : config.chunks) {
+                        if (size * transfers > config.max_disk) {
+                            std::cerr << "skipping " << transfers << " x " << size << " bytes, more than --max-disk\n";
+                            continue;
+                        }
+                        Libssh2Wrapper::DownloadOptions options;
+                        options.read_window = window;
+                        options.read_chunk_size = chunk;
+
+                        // fresh pools per run, so connection setup is part of every measurement
+                        Libssh2Wrapper::IoContextPool contexts(config.threads);
+                        Libssh2Wrapper::ShardedDownloadScheduler scheduler(contexts, (transfers + contexts.size() - 1) / contexts.size(), session);
+                        Libssh2Wrapper::Histogram latency;
+                        std::atomic<std::uint64_t> failures{0};
+
+                        auto start = std::chrono::steady_clock::now();
+                        for (std::uint64_t i = 0; i < transfers; ++i) {
+                            Libssh2Wrapper::DownloadJob job;
+                            job.target_host = "127.0.0.1";
+                            job.target_path = source;
+                            job.destination_path = directory + "/destination_" + std::to_string(i);
+                            job.username = username;
+                            job.options = options;
+                            job.handler = [&latency, &failures, start](const boost::system::error_code& ec) {
+                                if (ec) {
+                                    std::cerr << "download failed: " << ec.message() << "\n";
+                                    ++failures;
+                                    return;
+                                }
+                                latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+                            };
+                            scheduler.enqueue(std::move(job));
+                        }
+                        contexts.run();
+                        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+                        scheduler.clear();
+                        contexts.run();
+                        for (std::uint64_t i = 0; i < transfers; ++i) {
+                            std::remove((directory + "/destination_" + std::to_string(i)).c_str());
+                        }
+
+                        double bytes = static_cast<double>(size) * (transfers - failures);
+                        std::cout << "{\"label\":\"" << config.label << "\",\"bench\":\"download\",\"size_bytes\":" << size
+                            << ",\"concurrency\":" << transfers << ",\"threads\":" << config.threads << ",\"read_window\":" << window << ",\"read_chunk_size\":" << options.read_chunk_size
+                            << ",\"kex\":\"" << methodName(session.kex_methods) << "\",\"cipher\":\"" << methodName(session.cipher_methods) << "\",\"mac\":\"" << methodName(session.mac_methods)
+                            << "\",\"compress\":" << (session.compress ? "true" : "false") << ",\"data\":\"" << (config.text ? "text" : "random") << "\""
+                            << ",\"seconds\":" << elapsed.count() << ",\"mib_per_second\":" << bytes / (1024 * 1024) / elapsed.count()
+                            << ",\"latency_p50_us\":" << latency.percentile(0.5) / 1000.0 << ",\"latency_p99_us\":" << latency.percentile(0.99) / 1000.0
+                            << ",\"latency_max_us\":" << latency.max() / 1000.0 << ",\"failures\":" << failures << "}" << std::endl;
+                    }
+                }
+            }
+        }
+        std::remove(source.c_str());
+    }
+
+    std::cout << "{\"label\":\"" << config.label << "\",\"bench\":\"phases\",\"stats\":" << Libssh2Wrapper::TransferStats::global().toJson() << "}" << std::endl;
+}
+
+int main(int argc, char** argv) {
+
+    BenchConfig config{parseList("1K,64K,1M,16M,256M,4G"), parseList("1,4,16,64,256"), parseList("1,16,64"), parseList("32K"),
+        parseNames("default"), parseNames("default"), parseNames("default"), parseList("0"), 1, parseList("64G").front(), false, ""};
+    std::string sshd = std::getenv("SSHD") ? std::getenv("SSHD") : "/usr/sbin/sshd";
+
+    for (int i = 1; i < argc; i += 2) {
+        std::string option = argv[i];
+        if (i + 1 < argc && option == "--sizes") {
+            config.sizes = parseList(argv[i + 1]);
+        }
+        else if (i + 1 < argc && option == "--concurrency") {
+            config.concurrency = parseList(argv[i + 1]);
+        }
+        else if (i + 1 < argc && option == "--windows") {
+            config.windows = parseList(argv[i + 1]);
+        }
+        else if (i + 1 < argc && option == "--chunks") {
+            config.chunks = parseList(argv[i + 1]);
+        }
+        else if (i + 1 < argc && option == "--kex") {
+            config.kex = parseNames(argv[i + 1]);
+        }
+        else if (i + 1 < argc && option == "--ciphers") {
+            config.ciphers = parseNames(argv[i + 1]);
+        }
+        else if (i + 1 < argc && option == "--macs") {
+            config.macs = parseNames(argv[i + 1]);
+        }
+        else if (i + 1 < argc && option == "--compress") {
+            config.compress = parseList(argv[i + 1]);
+        }
+        else if (i + 1 < argc && option == "--max-disk") {
+            config.max_disk = parseList(argv[i + 1]).front();
+        }
+        else if (i + 1 < argc && option == "--data") {
+            config.text = std::string(argv[i + 1]) == "text";
+        }
+        else if (i + 1 < argc && option == "--threads") {
+            config.threads = std::max<std::uint64_t>(std::strtoull(argv[i + 1], nullptr, 10), 1);
+        }
+        else if (i + 1 < argc && option == "--label") {
+            config.label = argv[i + 1];
+        }
+        else {
+            std::cerr << "usage: " << argv[0] << " [--sizes 1K,1M,4G] [--concurrency 1,16,256] [--windows 1,64] [--chunks 16K,32K]"
+            << " [--kex default,curve25519-sha256] [--ciphers default,aes128-gcm@openssh.com,chacha20-poly1305@openssh.com,aes128-ctr]"
+            << " [--macs default,hmac-sha2-256-etm@openssh.com] [--compress 0,1] [--data random|text] [--max-disk 64G] [--threads 8] [--label name]\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (access(sshd.c_str(), X_OK) != 0) {
+        std::cerr << sshd << " not found, install the OpenSSH server or point SSHD at an sshd binary\n";
+        return EXIT_FAILURE;
+    }
+
+    int rc = libssh2_init(0);
+    if(rc != 0) {
+        throw std::runtime_error("libssh2 init failed");
+    }
+
+    char directory_template[] = "/tmp/libssh2-asio-bench-XXXXXX";
+    if (!mkdtemp(directory_template)) {
+        throw std::runtime_error("Failed to create a temporary directory");
+    }
+
+    int status = EXIT_SUCCESS;
+    try {
+        runBenchmarks(config, directory_template, sshd);
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        status = EXIT_FAILURE;
+    }
+    std::filesystem::remove_all(directory_template);
+
+    libssh2_exit();
+    return status;
+}
@@ -0,0 +1,113 @@
+#include <iostream>
+#include <exception>
+#include <memory>
+#include <atomic>
+#include <utility>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+
+#include <boost/version.hpp>
+#include <boost/asio.hpp>
+
+#include "Libssh2Wrapper.hpp"
+#define BENCH_COUNT_ALLOCATIONS
+#include "BenchSupport.hpp"
+
+using boost::asio::ip::tcp;
+
+struct Result {
+    std::string variant;
+    std::size_t waits;
+    double seconds;
+    std::size_t allocations;
+};
+
+void printResult(const Result& result)
+{
+    std::cout << result.variant << "," << result.waits << "," << (result.seconds * 1e9) / result.waits << "," << static_cast<double>(result.allocations) / result.waits << "\n";
+}
+
+// Waits on the socket the same way the callback chain waits on EAGAIN.
+struct CallbackWaiter {
+    tcp::socket& socket;
+    FdDriver::HandlerMemory& memory;
+    std::size_t remaining;
+    bool recycle;
+
+    void wait()
+    {
+        if (remaining-- == 0) {
+            return;
+        }
+        auto handler = [this](const boost::system::error_code& ec) {
+            if (ec) {
+                throw std::runtime_error(ec.message());
+            }
+            wait();
+        };
+        if (recycle) {
+            socket.async_wait(tcp::socket::wait_read, FdDriver::makeCustomAllocHandler(memory, std::move(handler)));
+        }
+        else {
+            socket.async_wait(tcp::socket::wait_read, std::move(handler));
+        }
+    }
+};
+
+boost::asio::awaitable<void> coroutineWaits(tcp::socket& socket, std::size_t waits)
+{
+    for (std::size_t i = 0; i < waits; ++i) {
+        co_await socket.async_wait(tcp::socket::wait_read, boost::asio::use_awaitable);
+    }
+}
+
+template <class Start>
+Result measure(const std::string& variant, boost::asio::io_context& ioc, std::size_t waits, Start&& start)
+{
+    ioc.restart();
+    std::size_t allocations = g_allocations;
+    auto begin = std::chrono::steady_clock::now();
+    start();
+    ioc.run();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    return Result{variant, waits, elapsed.count(), g_allocations - allocations};
+}
+
+int main(int argc, char** argv) {
+
+    std::size_t waits = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+    if (waits == 0) {
+        std::cout << "usage: " << argv[0] << " [waits]\n";
+        return EXIT_FAILURE;
+    }
+
+    boost::asio::io_context ioc;
+
+    // A loopback connection with one unread byte stays readable, so every wait completes on the next reactor pass.
+    tcp::acceptor acceptor(ioc, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    tcp::socket client(ioc);
+    client.connect(acceptor.local_endpoint());
+    tcp::socket server = acceptor.accept();
+    boost::asio::write(server, boost::asio::buffer("x", 1));
+
+    FdDriver::HandlerMemory memory;
+
+    std::cout << "variant,waits,ns_per_wait,allocations_per_wait\n";
+
+    CallbackWaiter plain{client, memory, waits, false};
+    printResult(measure("callback", ioc, waits, [&]() {
+        plain.wait();
+    }));
+
+    CallbackWaiter recycled{client, memory, waits, true};
+    printResult(measure("callback_handler_memory", ioc, waits, [&]() {
+        recycled.wait();
+    }));
+
+    printResult(measure("coroutine", ioc, waits, [&]() {
+        boost::asio::co_spawn(ioc, coroutineWaits(client, waits), boost::asio::detached);
+    }));
+
+    return EXIT_SUCCESS;
+}
@@ -1,6 +1,6 @@
-
 #include <iostream>
 #include <exception>
+#include <utility>
 
 #include <boost/version.hpp>
 #include <boost/asio.hpp>
@@ -12,17 +12,43 @@ int main(int argc, char** argv) {
     boost::asio::io_context ioc;
 
     X11Wrapper::ClipboardWriter writer(ioc);
-
-    boost::asio::post(ioc.get_executor(), [&](){
-        std::cout << "Reading clipboard message...\n";
-        std::cout << "res: " << X11Wrapper::readImpl() << "\n";
+    X11Wrapper::ClipboardReader reader(ioc);
+    X11Wrapper::ClipboardMonitor monitor(ioc);
+
+    auto print = [](const boost::system::error_code& ec, const std::string& data) {
+        if (ec) {
+            std::cerr << "read failed: " << ec.message() << "\n";
+            return;
+        }
+        std::cout << "res: " << data << "\n";
+    };
+
+    std::cout << "Reading clipboard message...\n";
+    reader.asyncRead("UTF8_STRING", print);
+
+    // the monitor sees the writer take ownership, fetches once and answers the second get from its cache
+    monitor.setChangeHandler([&]() {
+        std::cout << "Clipboard changed, reading it through the monitor...\n";
+        monitor.asyncGet("UTF8_STRING", print);
+        reader.asyncRead("text/html", [&](const boost::system::error_code& ec, std::string data) {
+            print(ec, data);
+            monitor.asyncGet("UTF8_STRING", [&](const boost::system::error_code& ec, const std::string& data) {
+                print(ec, data);
+                reader.close();
+                monitor.close();
+                writer.close();
+            });
+        });
     });
 
     std::cout << "Setting clipboard message...\n";
-    writer.setMsg("This is my clipboard message", [](){
-        std::cout << "Reading clipboard message...\n";
-        std::cout << "res: " << X11Wrapper::readImpl() << "\n";
+    auto content = X11Wrapper::ClipboardContent::text("This is my clipboard message");
+    // only converted if someone asks for it
+    content.addLazy("text/html", [](X11Wrapper::ClipboardContent::ProducerDone done) {
+        std::cout << "Converting to text/html...\n";
+        done(boost::system::error_code(), "<p>This is my clipboard message</p>");
     });
+    writer.setContent(std::move(content));
 
     ioc.run();
     
@@ -0,0 +1,177 @@
+#include <iostream>
+#include <exception>
+#include <utility>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <future>
+#include <cstdlib>
+
+#include <boost/version.hpp>
+#include <boost/asio.hpp>
+
+#include <unistd.h>
+
+#include "X11Wrapper.hpp"
+#include "BenchSupport.hpp"
+
+using BenchSupport::parseList;
+
+// Throwaway Xvfb on the first free display number, DISPLAY points at it while it runs.
+class LocalXvfb {
+public:
+    explicit LocalXvfb(const std::string& xvfb)
+    {
+        int number = 99;
+        while (access(("/tmp/.X11-unix/X" + std::to_string(number)).c_str(), F_OK) == 0 || access(("/tmp/.X" + std::to_string(number) + "-lock").c_str(), F_OK) == 0) {
+            ++number;
+        }
+        m_display = ":" + std::to_string(number);
+
+        m_server.start({xvfb, m_display, "-nolisten", "tcp", "-screen", "0", "64x64x24"}, [this]() {
+            Display* display = XOpenDisplay(m_display.c_str());
+            if (display) {
+                XCloseDisplay(display);
+            }
+            return display != nullptr;
+        });
+        setenv("DISPLAY", m_display.c_str(), 1);
+    }
+
+private:
+    std::string m_display;
+    BenchSupport::ServerProcess m_server;
+};
+
+// A client on its own connection that converts the clipboard requests times, waiting for each answer.
+void runRequestor(std::uint64_t requests, std::atomic<std::uint64_t>& failures)
+{
+    Display* display = XOpenDisplay(nullptr);
+    if (!display) {
+        failures += requests;
+        return;
+    }
+    Window window = XCreateSimpleWindow(display, DefaultRootWindow(display), 0, 0, 1, 1, 0, 0, 0);
+    Atom sel = XInternAtom(display, "CLIPBOARD", False);
+    Atom utf8 = XInternAtom(display, "UTF8_STRING", False);
+    Atom property = XInternAtom(display, "BENCH_DATA", False);
+
+    for (std::uint64_t i = 0; i < requests; ++i) {
+        XConvertSelection(display, sel, utf8, property, window, CurrentTime);
+        XEvent event;
+        do {
+            XNextEvent(display, &event);
+        } while (event.type != SelectionNotify);
+        if (event.xselection.property == None) {
+            ++failures;
+            continue;
+        }
+        Atom type;
+        int format;
+        unsigned long items, after;
+        unsigned char* data = nullptr;
+        XGetWindowProperty(display, window, property, 0, PROPERTY_READ_LONGS, True, AnyPropertyType, &type, &format, &items, &after, &data);
+        if (data) {
+            XFree(data);
+        }
+    }
+
+    XDestroyWindow(display, window);
+    XCloseDisplay(display);
+}
+
+struct BenchConfig {
+    std::vector<std::uint64_t> requestors;
+    std::uint64_t requests;
+    std::uint64_t payload;
+    std::string label;
+};
+
+// One JSON line per requestor count.
+void runBenchmarks(const BenchConfig& config, const std::string& xvfb)
+{
+    LocalXvfb server(xvfb);
+
+    boost::asio::io_context ioc;
+    X11Wrapper::ClipboardWriter writer(ioc);
+    std::promise<void> owned;
+    writer.setMsg(std::string(config.payload, 'x'), [&owned]() {
+        owned.set_value();
+    });
+    std::thread loop([&ioc]() {
+        ioc.run();
+    });
+    owned.get_future().wait();
+
+    for (std::uint64_t requestors : config.requestors) {
+        std::atomic<std::uint64_t> failures{0};
+        auto before = writer.stats();
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (std::uint64_t i = 0; i < requestors; ++i) {
+            threads.emplace_back(runRequestor, config.requests, std::ref(failures));
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        auto after = writer.stats();
+        std::uint64_t served = after.requests - before.requests;
+        std::uint64_t wakeups = after.wakeups - before.wakeups;
+        std::cout << "{\"label\":\"" << config.label << "\",\"bench\":\"clipboard\",\"requestors\":" << requestors
+            << ",\"requests_per_requestor\":" << config.requests << ",\"payload_bytes\":" << config.payload
+            << ",\"seconds\":" << elapsed.count() << ",\"requests_per_second\":" << served / elapsed.count()
+            << ",\"wakeups\":" << wakeups << ",\"events_per_wakeup\":" << (wakeups ? static_cast<double>(after.events - before.events) / wakeups : 0.0)
+            << ",\"failures\":" << failures << "}" << std::endl;
+    }
+
+    writer.close();
+    loop.join();
+}
+
+int main(int argc, char** argv) {
+
+    BenchConfig config{parseList("1,8,64"), 1000, 64, ""};
+    std::string xvfb = std::getenv("XVFB") ? std::getenv("XVFB") : "/usr/bin/Xvfb";
+
+    for (int i = 1; i < argc; i += 2) {
+        std::string option = argv[i];
+        if (i + 1 < argc && option == "--requestors") {
+            config.requestors = parseList(argv[i + 1]);
+        }
+        else if (i + 1 < argc && option == "--requests") {
+            config.requests = std::strtoull(argv[i + 1], nullptr, 10);
+        }
+        else if (i + 1 < argc && option == "--payload") {
+            config.payload = std::strtoull(argv[i + 1], nullptr, 10);
+        }
+        else if (i + 1 < argc && option == "--label") {
+            config.label = argv[i + 1];
+        }
+        else {
+            std::cerr << "usage: " << argv[0] << " [--requestors 1,8,64] [--requests 1000] [--payload 64] [--label name]\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (access(xvfb.c_str(), X_OK) != 0) {
+        std::cerr << xvfb << " not found, install Xvfb or point XVFB at an Xvfb binary\n";
+        return EXIT_FAILURE;
+    }
+
+    // the requestors open their displays from several threads
+    XInitThreads();
+
+    try {
+        runBenchmarks(config, xvfb);
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}